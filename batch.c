@@ -0,0 +1,299 @@
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "api.h"
+
+// Batch runner
+// Runs every policy on every input file of a directory in one process. Each
+// worker OS thread owns a scheduler instance and takes (policy, input) runs
+// off a shared counter; the instance, its fiber stacks and the worker's
+// buffers are reused from run to run. Every run writes the same Gantt chart
+// and metrics files as the tester, and one CSV line per run goes to stdout
+// in policy, input order.
+
+#define NUM_POLICIES 4
+#define MAX_LOG_SIZE 512
+
+struct job {
+    int type;
+    const char *input;          // file name in the input directory
+    bool ok;
+    struct sch_metrics metrics;
+    int threads;
+    double wall_ms;
+};
+
+struct batch {
+    const char *input_dir;
+    const char *output_dir;
+    struct sch_mlfq_config mlfq_config;
+    struct sch_cfs_config cfs_config;
+    int cpu_count;
+    int migration_cost;
+    int io_device_count;
+    enum io_discipline *io_disciplines;
+    struct job *jobs;
+    int job_count;
+    atomic_int next_job;
+};
+
+// Reused by all runs of one worker
+struct worker {
+    struct batch *batch;
+    struct sched_ctx *ctx;
+    struct sch_workload workload;  // input of the current run
+    char *gantt;                // Gantt chart text of the current run
+    size_t gantt_len;
+    size_t gantt_cap;
+};
+
+static void *checked_realloc(void *ptr, size_t size) {
+    void *res = realloc(ptr, size);
+    if (!res) {
+        perror("realloc() error");
+        exit(EXIT_FAILURE);
+    }
+    return res;
+}
+
+// Event listener, appends the Gantt line of the event
+static void gantt_event(const struct sch_event *event, void *arg) {
+    struct worker *w = (struct worker *)arg;
+    if (w->gantt_len + MAX_LOG_SIZE > w->gantt_cap) {
+        w->gantt_cap = w->gantt_cap ? w->gantt_cap * 2 : (1 << 16);
+        w->gantt = checked_realloc(w->gantt, w->gantt_cap);
+    }
+    w->gantt_len += format_gantt_line(w->gantt + w->gantt_len, MAX_LOG_SIZE, event, w->batch->cpu_count);
+}
+
+// Fiber body, the same calls as the tester's thread_start
+static void run_thread(int tid, void *arg) {
+    struct worker *w = (struct worker *)arg;
+    sched_replay_thread(w->ctx, &w->workload, tid);
+}
+
+static void run_job(struct worker *w, struct job *job) {
+    struct batch *b = w->batch;
+    char path[4096];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    snprintf(path, sizeof(path), "%s/%s", b->input_dir, job->input);
+    if (workload_load(path, &w->workload) != 0)
+        return;
+    int num_threads = w->workload.thread_count;
+    job->threads = num_threads;
+
+    if (w->ctx)
+        sched_reset(w->ctx, job->type, num_threads, b->cpu_count, b->migration_cost);
+    else
+        w->ctx = sched_create(job->type, num_threads, b->cpu_count, b->migration_cost);
+    if (b->io_device_count > 0)
+        sched_configure_io_devices(w->ctx, b->io_device_count, b->io_disciplines);
+    sched_configure_mlfq(w->ctx, &b->mlfq_config);
+    sched_configure_cfs(w->ctx, &b->cfs_config);
+    w->gantt_len = 0;
+    sched_set_event_listener(w->ctx, gantt_event, w);
+    snprintf(path, sizeof(path), "%s/metrics-%d-%s", b->output_dir, job->type, job->input);
+    sched_set_metrics_output(w->ctx, path);
+
+    // The runs already spread over the cores, one fiber worker each
+    sched_run_fibers(w->ctx, 1, run_thread, w);
+    sched_get_metrics(w->ctx, &job->metrics);
+    sched_finish(w->ctx);
+
+    snprintf(path, sizeof(path), "%s/gantt-%d-%s", b->output_dir, job->type, job->input);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror(path);
+        return;
+    }
+    if (fwrite(w->gantt, 1, w->gantt_len, fp) != w->gantt_len) {
+        fprintf(stderr, "%s: fwrite() failed.\n", path);
+        fclose(fp);
+        return;
+    }
+    fclose(fp);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    job->wall_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    job->ok = true;
+}
+
+static void *worker_start(void *arg) {
+    struct worker *w = (struct worker *)arg;
+    struct batch *b = w->batch;
+    int i;
+    while ((i = atomic_fetch_add(&b->next_job, 1)) < b->job_count)
+        run_job(w, &b->jobs[i]);
+
+    if (w->ctx)
+        sched_destroy(w->ctx);
+    workload_free(&w->workload);
+    free(w->gantt);
+    return NULL;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Regular files of dir sorted by name, hidden files left out
+static char **list_inputs(const char *dir, int *count) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror(dir);
+        exit(EXIT_FAILURE);
+    }
+    char **names = NULL;
+    int n = 0, cap = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+        char path[4096];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            names = checked_realloc(names, sizeof(*names) * cap);
+        }
+        names[n++] = strdup(ent->d_name);
+    }
+    closedir(d);
+    qsort(names, n, sizeof(*names), compare_names);
+    *count = n;
+    return names;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 9) {
+        fprintf(stderr, "Usage: ./batch <input_dir> [jobs] [output_dir] [mlfq_config] [cfs_config] [cpus] [migration_cost] [io_devices]\n");
+        fprintf(stderr, "  Runs policies 0, 1, 2 and 3 on every file in input_dir\n");
+        fprintf(stderr, "  jobs: simulations run at once (default: number of CPUs)\n");
+        fprintf(stderr, "  output_dir: Gantt charts and metrics (default output)\n");
+        fprintf(stderr, "  mlfq_config: MLFQ settings file or settings, as for the tester\n");
+        fprintf(stderr, "  cfs_config: CFS settings file or settings, as for the tester\n");
+        fprintf(stderr, "  cpus, migration_cost, io_devices: as for the tester (default 1, 0 and f)\n");
+        exit(EXIT_FAILURE);
+    }
+    struct batch b = {0};
+    b.input_dir = argv[1];
+    int jobs = (argc >= 3) ? atoi(argv[2]) : 0;
+    if (jobs < 1)
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1)
+        jobs = 1;
+    b.output_dir = (argc >= 4) ? argv[3] : "output";
+    mkdir(b.output_dir, 0755);
+    mlfq_default_config(&b.mlfq_config);
+    if (argc >= 5) {
+        struct stat st;
+        int err = stat(argv[4], &st) == 0 ? mlfq_load_config(argv[4], &b.mlfq_config)
+                                           : mlfq_parse_config(argv[4], &b.mlfq_config);
+        if (err) {
+            fprintf(stderr, "%s: invalid MLFQ config: %s\n", __func__, argv[4]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    cfs_default_config(&b.cfs_config);
+    if (argc >= 6) {
+        struct stat st;
+        int err = stat(argv[5], &st) == 0 ? cfs_load_config(argv[5], &b.cfs_config)
+                                           : cfs_parse_config(argv[5], &b.cfs_config);
+        if (err) {
+            fprintf(stderr, "%s: invalid CFS config: %s\n", __func__, argv[5]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    b.cpu_count = (argc >= 7) ? atoi(argv[6]) : 1;
+    if (b.cpu_count < 1)
+        b.cpu_count = 1;
+    b.migration_cost = (argc >= 8) ? atoi(argv[7]) : 0;
+    const char *io_spec = (argc >= 9) ? argv[8] : "f";
+    b.io_device_count = strlen(io_spec);
+    b.io_disciplines = checked_realloc(NULL, sizeof(*b.io_disciplines) * (b.io_device_count + 1));
+    for (int i = 0; i < b.io_device_count; ++i) {
+        if (io_spec[i] == 'f') {
+            b.io_disciplines[i] = IO_FIFO;
+        } else if (io_spec[i] == 's') {
+            b.io_disciplines[i] = IO_SHORTEST;
+        } else if (io_spec[i] == 'p') {
+            b.io_disciplines[i] = IO_PRIORITY;
+        } else {
+            fprintf(stderr, "%s: invalid I/O discipline: %c\n", __func__, io_spec[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int input_count;
+    char **inputs = list_inputs(b.input_dir, &input_count);
+    b.job_count = NUM_POLICIES * input_count;
+    b.jobs = calloc(b.job_count ? b.job_count : 1, sizeof(*b.jobs));
+    if (!b.jobs) {
+        perror("calloc() error");
+        exit(EXIT_FAILURE);
+    }
+    for (int type = 0; type < NUM_POLICIES; ++type) {
+        for (int i = 0; i < input_count; ++i) {
+            b.jobs[type * input_count + i].type = type;
+            b.jobs[type * input_count + i].input = inputs[i];
+        }
+    }
+    atomic_init(&b.next_job, 0);
+    if (jobs > b.job_count)
+        jobs = b.job_count > 0 ? b.job_count : 1;
+
+    struct worker *workers = calloc(jobs, sizeof(*workers));
+    pthread_t *threads = malloc(sizeof(*threads) * jobs);
+    if (!workers || !threads) {
+        perror("malloc() error");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < jobs; ++i) {
+        workers[i].batch = &b;
+        if (pthread_create(&threads[i], NULL, worker_start, &workers[i])) {
+            fprintf(stderr, "%s: pthread_create() error!\n", __func__);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < jobs; ++i)
+        pthread_join(threads[i], NULL);
+
+    int failed = 0;
+    printf("type,input,threads,makespan,threads_done,context_switches,cpu_utilization,wall_ms\n");
+    for (int i = 0; i < b.job_count; ++i) {
+        struct job *job = &b.jobs[i];
+        if (!job->ok) {
+            fprintf(stderr, "%s: policy %d on %s failed\n", __func__, job->type, job->input);
+            failed++;
+            continue;
+        }
+        printf("%d,%s,%d,%" PRId64 ",%d,%ld,%.4f,%.3f\n", job->type, job->input, job->threads,
+               job->metrics.makespan, job->metrics.threads_done, job->metrics.context_switches,
+               job->metrics.cpu_utilization, job->wall_ms);
+    }
+
+    for (int i = 0; i < input_count; ++i)
+        free(inputs[i]);
+    free(inputs);
+    free(b.jobs);
+    free(b.io_disciplines);
+    free(workers);
+    free(threads);
+    return failed ? EXIT_FAILURE : 0;
+}
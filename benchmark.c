@@ -0,0 +1,215 @@
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include "api.h"
+
+// Benchmark of the scheduler library itself
+// Runs every policy over CPU-bound, I/O-bound and semaphore-heavy workloads
+// from 10 threads up to max_threads, each case in its own process so peak
+// RSS is per case. The inputs come from workload_gen next to this binary and
+// are loaded and replayed the way tester and batch run theirs. Threads run
+// as fibers, one pthread per simulated thread does not scale to 100k
+// threads. Prints one CSV line per case.
+
+#define BENCH_SEED 0x5eed
+
+enum bench_mix {
+    MIX_CPU,    // long CPU bursts
+    MIX_IO,     // short CPU bursts between I/O
+    MIX_SEM,    // critical sections on shared semaphores
+    MIX_COUNT
+};
+
+static const char *mix_names[MIX_COUNT] = {"cpu", "io", "sem"};
+static const char *policy_names[] = {"fcfs", "srtf", "mlfq", "cfs"};
+
+// Counters filled by the event listener
+struct bench_stats {
+    int64_t ticks;          // simulated time of the last event
+    long context_switches;  // a core dispatched another thread than last tick
+    long wakeups;           // calls handed back to a waiting thread
+    int *last_tid;          // per core
+};
+
+// One case: the generated input replayed on its own instance
+struct bench_run {
+    struct sched_ctx *ctx;
+    struct sch_workload workload;
+};
+
+// Writes the input of a case to path with workload_gen. Arrivals are
+// Poisson with a rate that keeps the bottleneck resource about 90% busy, so
+// queues stay bounded as the thread count grows.
+static void generate(const char *gen, const char *path, enum bench_mix mix, int num_threads) {
+    char threads[16], seed[32], rate[32], sems[16];
+    snprintf(threads, sizeof(threads), "%d", num_threads);
+    snprintf(seed, sizeof(seed), "%llu",
+             (unsigned long long)(BENCH_SEED ^ ((uint64_t)mix << 32) ^ num_threads));
+    snprintf(sems, sizeof(sems), "%d", num_threads / 16 > 0 ? num_threads / 16 : 1);
+
+    // Two CPU bursts of 6, two I/Os of 8 between short bursts, or a
+    // critical section of 3 on one of num_threads / 16 locks
+    const char *args[MIX_COUNT][16] = {
+        [MIX_CPU] = {"-b", "2", "-c", "6", "-i", "0", NULL},
+        [MIX_IO] = {"-b", "3", "-c", "1", "-i", "1", "-d", "8", NULL},
+        [MIX_SEM] = {"-b", "1", "-c", "3", "-p", "mutex", "-k", sems, NULL},
+    };
+    double demand = mix == MIX_CPU ? 12.0 : mix == MIX_IO ? 16.0 : 5.0;
+    snprintf(rate, sizeof(rate), "%.6f", 0.9 / demand);
+
+    const char *argv[24] = {gen, "-n", threads, "-s", seed, "-r", rate};
+    int argc = 7;
+    for (int i = 0; args[mix][i] != NULL; ++i)
+        argv[argc++] = args[mix][i];
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork() error");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        if (freopen(path, "w", stdout) == NULL) {
+            perror("freopen() error");
+            _exit(EXIT_FAILURE);
+        }
+        execv(gen, (char *const *)argv);
+        perror("execv() error");
+        _exit(EXIT_FAILURE);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s: %s failed for %s %d threads\n", __func__, gen, mix_names[mix], num_threads);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void count_event(const struct sch_event *event, void *arg) {
+    struct bench_stats *stats = (struct bench_stats *)arg;
+    if (event->end > stats->ticks)
+        stats->ticks = event->end;
+
+    switch (event->type) {
+    case SCH_EVENT_DISPATCH:
+        if (stats->last_tid[event->core] != event->tid)
+            stats->context_switches++;
+        stats->last_tid[event->core] = event->tid;
+        break;
+    case SCH_EVENT_CPU:
+    case SCH_EVENT_IO_DONE:
+    case SCH_EVENT_P:
+    case SCH_EVENT_V:
+        stats->wakeups++;
+        break;
+    default:
+        break;
+    }
+}
+
+// Fiber starting point, the same calls tester makes for one input line
+static void bench_thread(int tid, void *arg) {
+    struct bench_run *run = (struct bench_run *)arg;
+    sched_replay_thread(run->ctx, &run->workload, tid);
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Runs one case and prints its CSV line, called in a child process
+static void run_case(int policy, enum bench_mix mix, const char *path, int workers) {
+    struct bench_run run = {0};
+    if (workload_load(path, &run.workload) != 0)
+        exit(EXIT_FAILURE);
+    int num_threads = run.workload.thread_count;
+
+    int last_tid = -1;
+    struct bench_stats stats = {0};
+    stats.last_tid = &last_tid;
+
+    double start = now_sec();
+    run.ctx = sched_create(policy, num_threads, 1, 0);
+    sched_set_event_listener(run.ctx, count_event, &stats);
+    sched_run_fibers(run.ctx, workers, bench_thread, &run);
+    sched_finish(run.ctx);
+    double wall = now_sec() - start;
+    sched_destroy(run.ctx);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%s,%s,%d,%" PRIu64 ",%.6f,%" PRId64 ",%.0f,%ld,%ld,%.4f,%ld\n",
+           policy_names[policy], mix_names[mix], num_threads, run.workload.op_count, wall, stats.ticks,
+           wall > 0 ? stats.ticks / wall : 0.0, stats.context_switches, stats.wakeups,
+           stats.ticks > 0 ? (double)stats.wakeups / stats.ticks : 0.0, usage.ru_maxrss);
+    fflush(stdout);
+    workload_free(&run.workload);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 3) {
+        fprintf(stderr, "Usage: ./benchmark [max_threads] [fiber_workers]\n");
+        fprintf(stderr, "  max_threads: largest thread count, cases go 10, 100, ... up to it (default 100000)\n");
+        fprintf(stderr, "  fiber_workers: OS threads running the fibers (default 1)\n");
+        exit(EXIT_FAILURE);
+    }
+    int max_threads = (argc >= 2) ? atoi(argv[1]) : 100000;
+    int workers = (argc >= 3) ? atoi(argv[2]) : 1;
+
+    // workload_gen is built next to the benchmark
+    const char *slash = strrchr(argv[0], '/');
+    int dir_len = slash != NULL ? (int)(slash - argv[0]) + 1 : 0;
+    char gen[4096];
+    snprintf(gen, sizeof(gen), "%.*sworkload_gen", dir_len, argv[0]);
+    const char *tmp = getenv("TMPDIR");
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/benchXXXXXX", tmp != NULL && tmp[0] != '\0' ? tmp : "/tmp");
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp() error");
+        exit(EXIT_FAILURE);
+    }
+    char path[4200];
+    snprintf(path, sizeof(path), "%s/input", dir);
+
+    printf("policy,mix,threads,ops,wall_s,ticks,ticks_per_s,context_switches,wakeups,wakeups_per_tick,peak_rss_kb\n");
+    fflush(stdout);
+    for (int num_threads = 10; num_threads <= max_threads; num_threads *= 10) {
+        for (int mix = 0; mix < MIX_COUNT; ++mix) {
+            generate(gen, path, mix, num_threads);
+            for (int policy = SCH_FCFS; policy <= SCH_CFS; ++policy) {
+                pid_t pid = fork();
+                if (pid < 0) {
+                    perror("fork() error");
+                    exit(EXIT_FAILURE);
+                }
+                if (pid == 0) {
+                    run_case(policy, mix, path, workers);
+                    exit(EXIT_SUCCESS);
+                }
+                int status;
+                waitpid(pid, &status, 0);
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    fprintf(stderr, "%s: %s %s %d threads failed\n", __func__,
+                            policy_names[policy], mix_names[mix], num_threads);
+                    unlink(path);
+                    rmdir(dir);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            unlink(path);
+        }
+    }
+    rmdir(dir);
+    return 0;
+}
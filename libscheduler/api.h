@@ -1,13 +1,32 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 // Scheduler type
 enum sch_type {
     SCH_FCFS = 0, // first come first served
     SCH_SRTF = 1, // shortest remaining time first
     SCH_MLFQ = 2, // multi-level feedback queue
+    SCH_CFS = 3,  // completely fair, virtual runtime weighted by nice
 };
 
+// Simulated time
+// The clock counts whole ticks in 64 bits. The time a thread passes to a
+// call may fall between ticks, a call takes effect at the next whole tick.
+// Call times are 64-bit fixed point with SCH_TIME_FRAC units per tick, so
+// they compare exactly at any distance from 0. The calls below take the
+// time as a float and return an int for the tester's interface; the sched_
+// calls further down take and return sch_time_t and do not lose precision
+// in long simulations.
+typedef int64_t sch_time_t;
+#define SCH_TIME_FRAC 1000000
+
 void init_scheduler(enum sch_type scheduler_type, int thread_count);
+// Simulates cpu_count CPUs, each with its own run queue. A thread that runs
+// on another CPU than last time spends migration_cost extra ticks there.
+// init_scheduler() is the same with one CPU.
+void init_scheduler_smp(enum sch_type scheduler_type, int thread_count, int cpu_count, int migration_cost);
 void finish_scheduler();
 
 int cpu_me(float current_time, int tid, int remaining_time);
@@ -16,9 +35,335 @@ int P(float current_time, int tid, int sem_id);
 int V(float current_time, int tid, int sem_id);
 void end_me(int tid);
 
-// MLFQ definitions
-static const int MLFQ_TIME_QUANTUM[5] = {5, 10, 15, 20, 25};
-// MLFQ_TIME_QUANTUM[0] is the highest, [4] is the lowest level
+// I/O devices
+enum io_discipline {
+    IO_FIFO = 0,     // requests in arrival order
+    IO_SHORTEST = 1, // shortest I/O first
+    IO_PRIORITY = 2, // highest MLFQ level first, arrival order within a level
+};
+
+// Sets up device_count I/O devices, device i serving its requests in
+// disciplines[i] order (all FIFO if disciplines is NULL). Call after
+// init_scheduler() and before threads run. By default there is a single
+// FIFO device.
+void configure_io_devices(int device_count, const enum io_discipline *disciplines);
+// io_me() on the given device, io_me() uses device 0
+int io_me_on(float current_time, int tid, int duration, int device);
+
+// MLFQ configuration
+// Level 0 is the highest. A thread starts every CPU burst at level 0 and
+// runs before any thread of a lower level. At a round robin level a thread
+// that used up the level's quantum goes to the back of the next level down,
+// or of its own level if it is the lowest. At an FCFS level the quantum is
+// not enforced and the thread keeps its level until the burst ends. Every
+// boost_interval ticks all threads go back to level 0.
+#define MLFQ_MAX_LEVELS 32
+
+enum mlfq_discipline {
+    MLFQ_RR = 0,   // quantum enforced, round robin
+    MLFQ_FCFS = 1, // first come first served, no quantum
+};
+
+struct sch_mlfq_config {
+    int levels;                                     // 1 to MLFQ_MAX_LEVELS
+    int quantum[MLFQ_MAX_LEVELS];                   // ticks per level
+    enum mlfq_discipline discipline[MLFQ_MAX_LEVELS];
+    int boost_interval;                             // 0: no boost
+};
+
+// 5 round robin levels with quanta 5, 10, 15, 20 and 25 ticks and no boost,
+// what init_scheduler() sets up
+void mlfq_default_config(struct sch_mlfq_config *config);
+// Parses "key = value" settings, one per line or separated by ',' or ';':
+//   levels = 3
+//   quantum = 4 8 16          one value per level, the last one repeats
+//   discipline = rr rr fcfs   rr or fcfs per level, the last one repeats
+//   boost = 200
+// '#' starts a comment. Keys not given keep their value in config. Returns
+// 0, or -1 with a message on stderr.
+int mlfq_parse_config(const char *text, struct sch_mlfq_config *config);
+// mlfq_parse_config() on the contents of a file
+int mlfq_load_config(const char *path, struct sch_mlfq_config *config);
+// Use config for the next run, call after init_scheduler() and before
+// threads run
+void configure_mlfq(const struct sch_mlfq_config *config);
+
+// CFS configuration
+// Every CPU runs the ready thread that had the least CPU time relative to
+// its weight. Nice -20 to 19 sets the weight as in Linux, each nice level
+// is worth about 10% CPU time. Once picked a thread keeps the CPU for its
+// share of target_latency, but at least min_granularity ticks; with more
+// threads than target_latency / min_granularity the period grows instead.
+struct sch_cfs_config {
+    int target_latency;     // ticks in which every ready thread runs once
+    int min_granularity;    // shortest slice in ticks
+};
+
+// Target latency 20 and min granularity 4 ticks, what init_scheduler()
+// sets up
+void cfs_default_config(struct sch_cfs_config *config);
+// Parses settings as mlfq_parse_config() does, keys "latency" and
+// "granularity"
+int cfs_parse_config(const char *text, struct sch_cfs_config *config);
+int cfs_load_config(const char *path, struct sch_cfs_config *config);
+// Use config for the next run, call after init_scheduler() and before
+// threads run
+void configure_cfs(const struct sch_cfs_config *config);
+// Nice value of tid, 0 by default. Call before threads run or from tid
+// between its calls, applies from its next CPU tick.
+void set_nice(int tid, int nice);
+
+// Scheduling policies
+// FCFS, SRTF, MLFQ and CFS are built in. Another policy is a set of
+// callbacks that keeps the ready threads of every CPU. A thread is enqueued
+// on a CPU when it becomes ready and stays queued while it runs, until
+// on_block() takes it off that CPU: its burst ended or another CPU steals
+// it. Every free CPU asks pick_next() for one tick, on_tick() follows once
+// the tick is granted. A CPU left free steals from the busiest other CPU,
+// never the thread that CPU is running: it asks pick_except() for another
+// one, or without that callback takes only what pick_next() names.
+// on_wake() comes before the enqueue of a thread starting a new CPU burst.
+// on_tick, on_wake, on_time and pick_except may be NULL.
+struct sch_thread_info {
+    int tid;
+    int remaining_time;  // of the burst, after the tick in on_tick()
+    sch_time_t ready_time;  // when the burst was requested
+    int last_cpu;        // -1 if the thread has not run
+};
+
+struct sch_policy {
+    const char *name;
+    void *(*create)(int thread_count, int cpu_count);
+    void (*destroy)(void *state);
+    // May be called again for a thread that is still queued on cpu
+    void (*enqueue)(void *state, int cpu, const struct sch_thread_info *thread);
+    // Queued thread to run next on cpu, -1 if none
+    int (*pick_next)(void *state, int cpu);
+    void (*on_tick)(void *state, int cpu, const struct sch_thread_info *thread);
+    void (*on_block)(void *state, int cpu, int tid);
+    void (*on_wake)(void *state, const struct sch_thread_info *thread);
+    // Threads queued on cpu, and whether tid is one of them
+    int (*count)(void *state, int cpu);
+    int (*queued)(void *state, int cpu, int tid);
+    // Before the CPUs are handed out at a tick where something happens,
+    // ticks where nothing does are skipped
+    void (*on_time)(void *state, int64_t time);
+    // Queued thread other than tid to run next on cpu, -1 if none. May be
+    // NULL, then a CPU only steals what pick_next() names.
+    int (*pick_except)(void *state, int cpu, int tid);
+};
+
+// Use policy instead of the built-in one until finish_scheduler(). Call
+// after init_scheduler() and before threads run; policy must stay valid
+// until then.
+void set_policy(const struct sch_policy *policy);
+
+// Event stream
+// The scheduler reports what happens in simulated-time order, each event
+// numbered by a sequence number that starts at 0 in init_scheduler().
+// The listener runs inside the library with the scheduler locked, it must be
+// quick and must not call back into the scheduler.
+enum sch_event_type {
+    SCH_EVENT_DISPATCH, // tid gets the CPU for start~end
+    SCH_EVENT_CPU,      // tid had the CPU for start~end
+    SCH_EVENT_IO_START, // tid's I/O runs start~end
+    SCH_EVENT_IO_DONE,  // tid returned from I/O at end
+    SCH_EVENT_BLOCK,    // tid blocked in P(sem_id)
+    SCH_EVENT_WAKE,     // tid woken by V(sem_id)
+    SCH_EVENT_P,        // tid returned from P(sem_id) at end
+    SCH_EVENT_V,        // tid returned from V(sem_id) at end
+    SCH_EVENT_END,      // tid called end_me
+};
+
+struct sch_event {
+    uint64_t seq;
+    enum sch_event_type type;
+    int tid;
+    int core;           // CPU the thread last ran on, -1 if it has not run
+    int64_t time;       // simulated time of the event
+    int64_t start;
+    int64_t end;
+    int sem_id;
+};
+
+typedef void (*sch_event_fn)(const struct sch_event *event, void *arg);
+void set_event_listener(sch_event_fn listener, void *arg);
+// Writes the Gantt chart line of a CPU, IO_DONE, P or V event to buf, with
+// the CPU it ran on if cpu_count > 1. Returns the length as snprintf()
+// does, 0 for the other events.
+int format_gantt_line(char *buf, size_t size, const struct sch_event *event, int cpu_count);
+
+// Metrics
+// Collected while the simulation runs, valid until finish_scheduler().
+struct sch_thread_metrics {
+    int tid;
+    double arrival;     // time of the first call, -1 before it
+    int64_t completion; // time of end_me(), -1 before it
+    double turnaround;  // completion - arrival
+    double response;    // first CPU tick - arrival, -1 before it
+    int64_t waiting;    // ticks ready but not running
+    int64_t cpu_time;
+    int64_t io_time;
+    int64_t sem_time;   // ticks blocked in P()
+    int64_t level_time[MLFQ_MAX_LEVELS];  // CPU ticks at each MLFQ level
+};
+
+struct sch_latency {
+    double mean;
+    int64_t p50;
+    int64_t p90;
+    int64_t p99;
+    int64_t max;
+};
+
+struct sch_metrics {
+    int64_t makespan;           // simulated time so far
+    int threads_done;
+    long context_switches;      // a CPU went to another thread than before
+    double cpu_utilization;     // busy CPU ticks / (CPUs * makespan)
+    double io_utilization;      // busy device ticks / (devices * makespan)
+    double throughput;          // threads done per tick
+    struct sch_latency turnaround;  // of the threads done
+    struct sch_latency waiting;
+    struct sch_latency response;
+};
+
+void get_metrics(struct sch_metrics *metrics);
+void get_thread_metrics(int tid, struct sch_thread_metrics *metrics);
+// finish_scheduler() writes per-thread metrics to <path_prefix>.csv and the
+// summary to <path_prefix>.json
+void set_metrics_output(const char *path_prefix);
+
+// Fiber execution mode
+// Runs entry(tid, arg) for every tid as a user-space fiber on worker_count
+// OS threads instead of one pthread per thread. Call after init_scheduler(),
+// returns once every fiber has returned from entry.
+typedef void (*fiber_entry_fn)(int tid, void* arg);
+void run_fibers(int worker_count, fiber_entry_fn entry, void* arg);
+
+// Workloads
+// The tester's input, one line per thread in tid order:
+//   <arrival> <tid> <op> ... E
+// with ops C<ticks> (CPU burst), I<ticks>[@<device>] (I/O), P<sem_id>,
+// V<sem_id> and N<nice> (nice value for the CPU ticks that follow).
+enum sch_op_type {
+    SCH_OP_CPU,
+    SCH_OP_IO,
+    SCH_OP_P,
+    SCH_OP_V,
+    SCH_OP_NICE,
+    SCH_OP_END,
+};
+
+struct sch_op {
+    uint8_t type;       // enum sch_op_type
+    uint8_t reserved;
+    uint16_t device;    // SCH_OP_IO only
+    int32_t arg;        // ticks, sem_id or nice
+};
+
+// Thread tid runs ops[first[tid]] to ops[first[tid + 1] - 1], the last one
+// SCH_OP_END
+struct sch_workload {
+    int thread_count;
+    uint64_t op_count;
+    const sch_time_t *arrival;
+    const uint64_t *first;
+    const struct sch_op *ops;
+
+    // Storage of the arrays above, kept when the workload is loaded again
+    sch_time_t *arrival_buf;
+    uint64_t *first_buf;
+    struct sch_op *op_buf;
+    size_t arrival_cap;
+    size_t first_cap;
+    size_t op_cap;
+    void *map;          // mapped compiled workload, the arrays point into it
+    size_t map_len;
+};
+
+// Parses the text file at path in one pass over a read-only mapping.
+// workload must be zeroed or loaded before. Returns 0, or -1 with
+// "path:line:column: message" on stderr.
+int workload_load_text(const char *path, struct sch_workload *workload);
+
+// Compiled workloads
+// workload_save() writes a workload as a versioned binary file: a header,
+// the arrival times, the offset table and the op records, in this host's
+// byte order. workload_load() maps such a file and uses the arrays in
+// place, with nothing to parse or copy; any other file is parsed with
+// workload_load_text(). Both return 0, or -1 with a message on stderr.
+int workload_save(const char *path, const struct sch_workload *workload);
+int workload_load(const char *path, struct sch_workload *workload);
+void workload_free(struct sch_workload *workload);
+// Runs thread tid's ops from its arrival time up to end_me(). Call from
+// the thread, or the fiber, that stands for tid.
+void replay_thread(const struct sch_workload *workload, int tid);
+
+// Stream runs
+// Replays the workload's threads as fibers on worker_count OS threads. A
+// thread is admitted only when the simulation reaches its arrival time and
+// its TCB and fiber are reused once it ends, so memory follows the threads
+// alive at once instead of the length of the workload. Call after
+// init_scheduler() for 0 threads. The metrics CSV then lists threads as they
+// end, and get_thread_metrics() only knows the live ones.
+void run_stream(int worker_count, const struct sch_workload *workload);
+
+// Checkpoints
+// checkpoint_at() makes the run write its whole state to path once the
+// clock reaches time: every thread's call and place in its workload, the
+// ready queues with MLFQ levels, quanta and CFS virtual runtimes, the
+// semaphores and their waiters, the I/O devices and the metrics so far. The
+// run then goes on. The threads must be run by replay_thread(); stream runs
+// cannot be checkpointed.
+//
+// restore_checkpoint() puts a run that has not started at the checkpoint.
+// Call it after init_scheduler() for the same workload, CPUs and I/O devices
+// and after any configure_ call or set_policy(), then start the threads as
+// usual: replay_thread() goes on from where each thread was, and the Gantt
+// chart and metrics continue from the checkpoint. The policy and its MLFQ
+// or CFS settings may differ from the checkpointed run. Returns 0, or -1
+// with a message on stderr, the instance then needs a new init_scheduler().
+void checkpoint_at(int64_t time, const char *path);
+int restore_checkpoint(const char *path, const struct sch_workload *workload);
+
+// Scheduler instances
+// All simulation state lives in a struct sched_ctx, so independent
+// simulations can run concurrently in one process, each with its own
+// threads. The functions above act on a default instance that
+// init_scheduler() creates and finish_scheduler() destroys; every one of them
+// has a sched_ counterpart taking the instance.
+struct sched_ctx;
+
+struct sched_ctx *sched_create(enum sch_type scheduler_type, int thread_count, int cpu_count, int migration_cost);
+// Starts a new run on ctx after sched_finish(). Memory of earlier runs is
+// kept and reused, so a batch of runs allocates only as much as its largest.
+void sched_reset(struct sched_ctx *ctx, enum sch_type scheduler_type, int thread_count, int cpu_count, int migration_cost);
+// Ends the run once every thread returned: writes the metrics output and
+// drops the event listener and policy. Metrics stay readable until the next reset.
+void sched_finish(struct sched_ctx *ctx);
+void sched_destroy(struct sched_ctx *ctx);
+
+sch_time_t sched_cpu_me(struct sched_ctx *ctx, sch_time_t current_time, int tid, int remaining_time);
+sch_time_t sched_io_me(struct sched_ctx *ctx, sch_time_t current_time, int tid, int duration);
+sch_time_t sched_io_me_on(struct sched_ctx *ctx, sch_time_t current_time, int tid, int duration, int device);
+sch_time_t sched_P(struct sched_ctx *ctx, sch_time_t current_time, int tid, int sem_id);
+sch_time_t sched_V(struct sched_ctx *ctx, sch_time_t current_time, int tid, int sem_id);
+void sched_end_me(struct sched_ctx *ctx, int tid);
+
+void sched_configure_io_devices(struct sched_ctx *ctx, int device_count, const enum io_discipline *disciplines);
+void sched_configure_mlfq(struct sched_ctx *ctx, const struct sch_mlfq_config *config);
+void sched_configure_cfs(struct sched_ctx *ctx, const struct sch_cfs_config *config);
+void sched_set_nice(struct sched_ctx *ctx, int tid, int nice);
+void sched_set_policy(struct sched_ctx *ctx, const struct sch_policy *policy);
+void sched_set_event_listener(struct sched_ctx *ctx, sch_event_fn listener, void *arg);
+void sched_get_metrics(struct sched_ctx *ctx, struct sch_metrics *metrics);
+void sched_get_thread_metrics(struct sched_ctx *ctx, int tid, struct sch_thread_metrics *metrics);
+void sched_set_metrics_output(struct sched_ctx *ctx, const char *path_prefix);
+void sched_run_fibers(struct sched_ctx *ctx, int worker_count, fiber_entry_fn entry, void *arg);
+void sched_replay_thread(struct sched_ctx *ctx, const struct sch_workload *workload, int tid);
+void sched_run_stream(struct sched_ctx *ctx, int worker_count, const struct sch_workload *workload);
+void sched_checkpoint_at(struct sched_ctx *ctx, int64_t time, const char *path);
+int sched_restore_checkpoint(struct sched_ctx *ctx, const char *path, const struct sch_workload *workload);
 
-// Semaphore definitions
-#define MAX_NUM_SEM 10 // sem_id from 0 to 9
+// Semaphores are created on first use with value 0, any int is a valid sem_id
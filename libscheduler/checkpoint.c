@@ -0,0 +1,498 @@
+#include "api.h"
+#include "scheduler.h"
+#include <sys/stat.h>
+#include <errno.h>
+
+// Checkpoints
+// The simulation writes a checkpoint when it moves its clock forward. At
+// that point every published operation is on the calendar and every live
+// thread is inside a call, waiting for it to return, so a thread's whole
+// state is its TCB plus where replay_thread() is in the workload. The file
+// holds the TCBs, the per-core and per-device state, the semaphores and the
+// metrics; which heap or queue a thread is in is a flag of its record and
+// the heaps are rebuilt on restore, their order follows from the TCBs.
+//
+// A restored run starts its threads as usual. Each one re-enters the call
+// it was in without publishing it again, see resume_op(), and the last one
+// to do so runs the simulation from the checkpoint on.
+
+#define CHECKPOINT_MAGIC 0x4b484353u  // "SCHK" in little endian
+#define CHECKPOINT_VERSION 2
+
+// File layout, in this host's byte order: the header, a record per thread
+// in tid order, per core, per I/O device and per semaphore, then the metrics
+// as metrics_save() writes them.
+struct checkpoint_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t policy;             // enum sch_type, -1 for a set_policy() policy
+    int32_t thread_count;
+    int32_t core_count;
+    int32_t io_device_count;
+    int32_t sem_count;
+    int32_t mlfq_levels;        // MLFQ config of the levels, quanta and next_boost
+    int32_t boost_interval;
+    int32_t mlfq_quantum[MLFQ_MAX_LEVELS];
+    int32_t mlfq_discipline[MLFQ_MAX_LEVELS];
+    int32_t pad;
+    int64_t global_time;
+    int64_t next_boost;
+    uint64_t io_request_seq;
+    uint64_t event_seq;
+};
+
+struct checkpoint_thread {
+    int64_t op_time;
+    int64_t ready_time;
+    int64_t event_time;
+    int64_t return_time;
+    uint64_t io_seq;
+    uint64_t replay_op;
+    int64_t vruntime;
+    int32_t replay_left;
+    int32_t state;
+    int32_t op;
+    int32_t op_arg;
+    int32_t event_type;
+    int32_t remaining_time;
+    int32_t last_cpu_remaining;
+    int32_t io_device;
+    int32_t core;
+    int32_t last_core;
+    int32_t level;
+    int32_t quantum_used;
+    int32_t weight;
+    int32_t cfs_core;
+    uint8_t on_calendar;
+    uint8_t waiting;            // in its device's or semaphore's heap
+    uint8_t queued;             // in the policy's ready queue of its core
+    uint8_t waking;
+    int32_t pad;
+};
+
+struct checkpoint_core {
+    int64_t min_vruntime;
+    int32_t current;            // tid, -1 if none
+    int32_t cfs_curr;
+    int32_t slice_used;
+    int32_t pad;
+};
+
+struct checkpoint_device {
+    int64_t time;
+    int32_t current;
+    int32_t pad;
+};
+
+struct checkpoint_sem {
+    int32_t id;
+    int32_t value;
+};
+
+static int32_t tid_of(const thread_control_block_t* tcb) {
+    return tcb != NULL ? tcb->tid : -1;
+}
+
+// The policy of the run, -1 for a set_policy() one
+static int32_t run_policy(sched_ctx_t* ctx) {
+    return ctx->policy != NULL ? -1 : (int32_t)ctx->scheduler_type;
+}
+
+// queued[tid] is set for the threads in a ready queue of the run's policy
+static void mark_queued(sched_ctx_t* ctx, uint8_t* queued) {
+    if (ctx->policy == NULL && ctx->scheduler_type == SCH_FCFS) {
+        for (int c = 0; c < ctx->core_count; c++) {
+            queue_t* q = &ctx->cores[c].ready_queue;
+            for (int i = 0; i < q->count; i++) {
+                queued[q->threads[(q->front + i) % q->capacity]->tid] = 1;
+            }
+        }
+        return;
+    }
+    for (int tid = 0; tid < ctx->thread_count; tid++) {
+        thread_control_block_t* tcb = ctx->threads[tid];
+        if (ctx->policy != NULL) {
+            queued[tid] = tcb->core != -1 && ext_queued(ctx, &ctx->cores[tcb->core], tcb);
+        } else {
+            queued[tid] = tcb->heap_pos[HEAP_SLOT_READY] >= 0;
+        }
+    }
+}
+
+static void save_thread(sched_ctx_t* ctx, thread_control_block_t* tcb, bool queued, struct checkpoint_thread* rec) {
+    mlfq_info_t* mlfq = &ctx->mlfq_data[tcb->slot];
+    cfs_info_t* cfs = &ctx->cfs_data[tcb->slot];
+    memset(rec, 0, sizeof(*rec));
+    rec->op_time = tcb->op_time;
+    rec->ready_time = tcb->ready_time;
+    rec->event_time = tcb->event_time;
+    rec->return_time = tcb->return_time;
+    rec->io_seq = tcb->io_seq;
+    rec->replay_op = tcb->replay_op;
+    rec->vruntime = cfs->vruntime;
+    rec->replay_left = tcb->replay_left;
+    rec->state = tcb->state;
+    rec->op = tcb->op;
+    rec->op_arg = tcb->op_arg;
+    rec->event_type = tcb->event_type;
+    rec->remaining_time = tcb->remaining_time;
+    rec->last_cpu_remaining = tcb->last_cpu_remaining;
+    rec->io_device = tcb->io_device;
+    rec->core = tcb->core;
+    rec->last_core = tcb->last_core;
+    rec->level = mlfq->level;
+    rec->quantum_used = mlfq->quantum_used;
+    rec->weight = cfs->weight;
+    rec->cfs_core = cfs->core;
+    rec->on_calendar = tcb->heap_pos[HEAP_SLOT_EVENT] >= 0;
+    rec->waiting = tcb->heap_pos[HEAP_SLOT_WAIT] >= 0;
+    rec->queued = queued;
+    rec->waking = cfs->waking;
+}
+
+// Whether the run's MLFQ config is the one the checkpoint was taken under
+static bool same_mlfq_config(sched_ctx_t* ctx, const struct checkpoint_header* header) {
+    if (header->mlfq_levels != ctx->mlfq.levels || header->boost_interval != ctx->mlfq.boost_interval) {
+        return false;
+    }
+    for (int lvl = 0; lvl < ctx->mlfq.levels; lvl++) {
+        if (header->mlfq_quantum[lvl] != ctx->mlfq.quantum[lvl] ||
+            header->mlfq_discipline[lvl] != (int32_t)ctx->mlfq.discipline[lvl]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool save_checkpoint(sched_ctx_t* ctx, FILE* fp, const uint8_t* queued) {
+    struct checkpoint_header header = {
+        .magic = CHECKPOINT_MAGIC,
+        .version = CHECKPOINT_VERSION,
+        .policy = run_policy(ctx),
+        .thread_count = ctx->thread_count,
+        .core_count = ctx->core_count,
+        .io_device_count = ctx->io_device_count,
+        .sem_count = ctx->semaphores.count,
+        .mlfq_levels = ctx->mlfq.levels,
+        .boost_interval = ctx->mlfq.boost_interval,
+        .global_time = ctx->global_time,
+        .next_boost = ctx->next_boost,
+        .io_request_seq = ctx->io_request_seq,
+        .event_seq = ctx->event_seq,
+    };
+    for (int lvl = 0; lvl < MLFQ_MAX_LEVELS; lvl++) {
+        header.mlfq_quantum[lvl] = ctx->mlfq.quantum[lvl];
+        header.mlfq_discipline[lvl] = ctx->mlfq.discipline[lvl];
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    for (int tid = 0; ok && tid < ctx->thread_count; tid++) {
+        struct checkpoint_thread rec;
+        save_thread(ctx, ctx->threads[tid], queued[tid], &rec);
+        ok = fwrite(&rec, sizeof(rec), 1, fp) == 1;
+    }
+    for (int c = 0; ok && c < ctx->core_count; c++) {
+        core_t* core = &ctx->cores[c];
+        struct checkpoint_core rec = {
+            .min_vruntime = core->min_vruntime,
+            .current = tid_of(core->current),
+            .cfs_curr = tid_of(core->cfs_curr),
+            .slice_used = core->slice_used,
+        };
+        ok = fwrite(&rec, sizeof(rec), 1, fp) == 1;
+    }
+    for (int i = 0; ok && i < ctx->io_device_count; i++) {
+        io_device_t* dev = &ctx->io_devices[i];
+        struct checkpoint_device rec = {.time = dev->time, .current = tid_of(dev->current)};
+        ok = fwrite(&rec, sizeof(rec), 1, fp) == 1;
+    }
+    for (int i = 0; ok && i < ctx->semaphores.capacity; i++) {
+        semaphore_t* sem = ctx->semaphores.slots[i];
+        if (sem == NULL) continue;
+        struct checkpoint_sem rec = {.id = sem->id, .value = sem->value};
+        ok = fwrite(&rec, sizeof(rec), 1, fp) == 1;
+    }
+    return ok && metrics_save(ctx, fp);
+}
+
+// Called from run_simulation() with ctx->mutex held once the clock reached
+// ctx->checkpoint_time. The run goes on whether or not the file was written.
+void write_checkpoint(sched_ctx_t* ctx) {
+    const char* path = ctx->checkpoint_path;
+    ctx->checkpoint_time = INT64_MAX;
+    if (ctx->stream.workload != NULL) {
+        TRACE_ERROR("%s: a stream run cannot be checkpointed\n", path);
+        return;
+    }
+    for (int tid = 0; tid < ctx->thread_count; tid++) {
+        thread_control_block_t* tcb = ctx->threads[tid];
+        if (tcb->state != STATE_TERMINATED && tcb->replay_op == UINT64_MAX) {
+            TRACE_ERROR("%s: T%d is not run by replay_thread(), no checkpoint\n", path, tid);
+            return;
+        }
+    }
+
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        TRACE_ERROR("%s: %s\n", path, strerror(errno));
+        return;
+    }
+    uint8_t* queued = checked_realloc(NULL, ctx->thread_count + 1);
+    memset(queued, 0, ctx->thread_count + 1);
+    mark_queued(ctx, queued);
+    bool ok = save_checkpoint(ctx, fp, queued);
+    free(queued);
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) {
+        TRACE_ERROR("%s: write failed\n", path);
+        return;
+    }
+    TRACE_INFO("%s: checkpoint at time %" PRId64 "\n", path, ctx->global_time);
+}
+
+// Check a thread record against the instance and the workload, returns
+// what is wrong or NULL
+static const char* check_thread(sched_ctx_t* ctx, const struct sch_workload* workload, int tid,
+                                const struct checkpoint_thread* rec) {
+    if (rec->state < STATE_READY || rec->state > STATE_TERMINATED || rec->op < OP_NONE ||
+        rec->op > OP_END || (rec->event_type != EVENT_RELEASE && rec->event_type != EVENT_OP)) {
+        return "invalid thread state";
+    }
+    if (rec->core < -1 || rec->core >= ctx->core_count || rec->last_core < -1 ||
+        rec->last_core >= ctx->core_count || rec->cfs_core < -1 || rec->cfs_core >= ctx->core_count ||
+        rec->io_device < 0 || rec->io_device >= ctx->io_device_count || rec->level < 0 ||
+        rec->level >= MLFQ_MAX_LEVELS) {
+        return "thread on a CPU, device or MLFQ level that does not exist";
+    }
+    if ((rec->queued && rec->core == -1) ||
+        (rec->waiting && rec->state != STATE_BLOCKED_IO && rec->state != STATE_BLOCKED_SEM)) {
+        return "thread in a queue it cannot be in";
+    }
+    if (rec->state == STATE_TERMINATED) return NULL;
+
+    // The call the thread is in is the op its cursor is at
+    static const op_type_t call_of[] = {
+        [SCH_OP_CPU] = OP_CPU, [SCH_OP_IO] = OP_IO, [SCH_OP_P] = OP_P, [SCH_OP_V] = OP_V,
+        [SCH_OP_NICE] = OP_NONE, [SCH_OP_END] = OP_END,
+    };
+    if (rec->replay_op < workload->first[tid] || rec->replay_op >= workload->first[tid + 1]) {
+        return "thread is not in the workload";
+    }
+    const struct sch_op* op = &workload->ops[rec->replay_op];
+    if (op->type > SCH_OP_END || call_of[op->type] != rec->op || rec->op == OP_END ||
+        (op->type == SCH_OP_CPU && (rec->replay_left < 0 || rec->replay_left > op->arg))) {
+        return "thread is not in the workload";
+    }
+    return NULL;
+}
+
+// Under another policy the thread's MLFQ and CFS state starts out as in a
+// fresh run, only its weight is kept. Under another MLFQ config it stays on
+// its level as far as the config has one, with a new quantum.
+static void restore_thread(sched_ctx_t* ctx, thread_control_block_t* tcb, const struct checkpoint_thread* rec,
+                           bool same_policy, bool same_mlfq) {
+    mlfq_info_t* mlfq = &ctx->mlfq_data[tcb->slot];
+    cfs_info_t* cfs = &ctx->cfs_data[tcb->slot];
+    tcb->op_time = rec->op_time;
+    tcb->ready_time = rec->ready_time;
+    tcb->event_time = rec->event_time;
+    tcb->return_time = rec->return_time;
+    tcb->io_seq = rec->io_seq;
+    tcb->replay_op = rec->replay_op;
+    tcb->replay_left = rec->replay_left;
+    tcb->state = rec->state;
+    tcb->op = rec->op;
+    tcb->op_arg = rec->op_arg;
+    tcb->event_type = rec->event_type;
+    tcb->remaining_time = rec->remaining_time;
+    tcb->last_cpu_remaining = rec->last_cpu_remaining;
+    tcb->io_device = rec->io_device;
+    tcb->core = rec->core;
+    tcb->last_core = rec->last_core;
+    tcb->released = false;
+    tcb->resume = true;
+    cfs->weight = rec->weight;
+    if (!same_policy) {
+        mlfq->level = 0;
+        mlfq->quantum_used = 0;
+        cfs->vruntime = 0;
+        cfs->core = -1;
+        cfs->waking = false;
+        return;
+    }
+    mlfq->level = rec->level;
+    mlfq->quantum_used = rec->quantum_used;
+    if (!same_mlfq) {
+        if (mlfq->level >= ctx->mlfq.levels) mlfq->level = ctx->mlfq.levels - 1;
+        mlfq->quantum_used = 0;
+    }
+    cfs->vruntime = rec->vruntime;
+    cfs->core = rec->cfs_core;
+    cfs->waking = rec->waking;
+}
+
+// The run's policy takes tcb into its core's ready queue
+static void enqueue_ready(sched_ctx_t* ctx, thread_control_block_t* tcb) {
+    core_t* core = &ctx->cores[tcb->core];
+    if (ctx->policy != NULL) {
+        ext_enqueue(ctx, core, tcb);
+        return;
+    }
+    switch (ctx->scheduler_type) {
+        case SCH_SRTF: srtf_enqueue(ctx, core, tcb); break;
+        case SCH_MLFQ: mlfq_enqueue(ctx, core, tcb); break;
+        case SCH_CFS: cfs_enqueue(ctx, core, tcb); break;
+        default: fcfs_enqueue(ctx, core, tcb); break;
+    }
+}
+
+// Read the checkpoint into ctx, returns what is wrong or NULL. Nothing is
+// changed before the records have been checked, except the metrics.
+static const char* load_checkpoint(sched_ctx_t* ctx, FILE* fp, const struct sch_workload* workload) {
+    struct checkpoint_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != CHECKPOINT_MAGIC) {
+        return "not a checkpoint";
+    }
+    if (header.version != CHECKPOINT_VERSION) return "unsupported checkpoint version";
+    if (ctx->stream.workload != NULL) return "a stream run cannot be restored";
+    if (header.thread_count != ctx->thread_count || header.thread_count != workload->thread_count) {
+        return "checkpoint of another number of threads";
+    }
+    if (header.core_count != ctx->core_count || header.io_device_count != ctx->io_device_count) {
+        return "checkpoint of another number of CPUs or I/O devices";
+    }
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || header.sem_count < 0 ||
+        (uint64_t)header.sem_count * sizeof(struct checkpoint_sem) > (uint64_t)st.st_size) {
+        return "truncated or corrupt checkpoint";
+    }
+
+    int count = header.thread_count;
+    struct checkpoint_thread* threads = checked_realloc(NULL, sizeof(*threads) * (count + 1));
+    struct checkpoint_core* cores = checked_realloc(NULL, sizeof(*cores) * header.core_count);
+    struct checkpoint_device* devices = checked_realloc(NULL, sizeof(*devices) * header.io_device_count);
+    struct checkpoint_sem* sems = checked_realloc(NULL, sizeof(*sems) * (header.sem_count + 1));
+    const char* err = NULL;
+    if (fread(threads, sizeof(*threads), count, fp) != (size_t)count ||
+        fread(cores, sizeof(*cores), header.core_count, fp) != (size_t)header.core_count ||
+        fread(devices, sizeof(*devices), header.io_device_count, fp) != (size_t)header.io_device_count ||
+        fread(sems, sizeof(*sems), header.sem_count, fp) != (size_t)header.sem_count) {
+        err = "truncated or corrupt checkpoint";
+    }
+    int live = 0;
+    for (int tid = 0; err == NULL && tid < count; tid++) {
+        err = check_thread(ctx, workload, tid, &threads[tid]);
+        if (threads[tid].state != STATE_TERMINATED) live++;
+    }
+    for (int c = 0; err == NULL && c < header.core_count; c++) {
+        if (cores[c].current < -1 || cores[c].current >= count || cores[c].cfs_curr < -1 ||
+            cores[c].cfs_curr >= count) {
+            err = "CPU runs a thread that does not exist";
+        }
+    }
+    for (int i = 0; err == NULL && i < header.io_device_count; i++) {
+        if (devices[i].current < -1 || devices[i].current >= count) {
+            err = "I/O device serves a thread that does not exist";
+        }
+    }
+    if (err == NULL && !metrics_load(ctx, fp)) err = "truncated or corrupt checkpoint";
+    if (err != NULL) {
+        free(threads);
+        free(cores);
+        free(devices);
+        free(sems);
+        return err;
+    }
+
+    ctx->global_time = header.global_time;
+    ctx->io_request_seq = header.io_request_seq;
+    ctx->event_seq = header.event_seq;
+    // Under another MLFQ config the next boost is the next multiple of its
+    // interval
+    bool same_policy = header.policy != -1 && header.policy == run_policy(ctx);
+    bool same_mlfq = same_mlfq_config(ctx, &header);
+    int interval = ctx->mlfq.boost_interval;
+    if (same_mlfq) {
+        ctx->next_boost = header.next_boost;
+    } else if (interval > 0) {
+        int64_t next = (ctx->global_time + interval - 1) / interval * interval;
+        ctx->next_boost = next > interval ? next : interval;
+    }
+
+    for (int tid = 0; tid < count; tid++) {
+        restore_thread(ctx, ctx->threads[tid], &threads[tid], same_policy, same_mlfq);
+    }
+    for (int c = 0; c < header.core_count; c++) {
+        core_t* core = &ctx->cores[c];
+        core->current = cores[c].current >= 0 ? ctx->threads[cores[c].current] : NULL;
+        if (same_policy) {
+            core->cfs_curr = cores[c].cfs_curr >= 0 ? ctx->threads[cores[c].cfs_curr] : NULL;
+            core->min_vruntime = cores[c].min_vruntime;
+            core->slice_used = cores[c].slice_used;
+        }
+    }
+    for (int i = 0; i < header.io_device_count; i++) {
+        io_device_t* dev = &ctx->io_devices[i];
+        dev->time = devices[i].time;
+        dev->current = devices[i].current >= 0 ? ctx->threads[devices[i].current] : NULL;
+    }
+    for (int i = 0; i < header.sem_count; i++) {
+        find_semaphore(&ctx->semaphores, sems[i].id)->value = sems[i].value;
+    }
+
+    // Under the same policy the ready queues are as they were. Another
+    // policy only gets the threads waiting for a CPU; a running thread joins
+    // its queue with the next call, as FCFS has it. Their MLFQ and CFS
+    // state starts out as in a fresh run, see restore_thread().
+    for (int tid = 0; tid < count; tid++) {
+        thread_control_block_t* tcb = ctx->threads[tid];
+        const struct checkpoint_thread* rec = &threads[tid];
+        if (rec->on_calendar) heap_push(&ctx->event_queue, tcb);
+        if (rec->waiting && tcb->state == STATE_BLOCKED_IO) {
+            heap_push(&ctx->io_devices[tcb->io_device].requests, tcb);
+        } else if (rec->waiting) {
+            heap_push(&find_semaphore(&ctx->semaphores, tcb->op_arg)->blocked, tcb);
+        }
+        if (rec->queued && (same_policy || ctx->cores[tcb->core].current != tcb)) {
+            enqueue_ready(ctx, tcb);
+        }
+    }
+    // The live threads come back into their calls, see resume_op()
+    atomic_store(&ctx->unpublished_count, live);
+    atomic_store(&ctx->published_ops, NULL);
+
+    free(threads);
+    free(cores);
+    free(devices);
+    free(sems);
+    return NULL;
+}
+
+void sched_checkpoint_at(sched_ctx_t* ctx, int64_t time, const char* path) {
+    pthread_mutex_lock(&ctx->mutex);
+    free(ctx->checkpoint_path);
+    ctx->checkpoint_path = NULL;
+    ctx->checkpoint_time = INT64_MAX;
+    if (path != NULL) {
+        ctx->checkpoint_path = checked_realloc(NULL, strlen(path) + 1);
+        strcpy(ctx->checkpoint_path, path);
+        ctx->checkpoint_time = time;
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+int sched_restore_checkpoint(sched_ctx_t* ctx, const char* path, const struct sch_workload* workload) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        TRACE_ERROR("%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    pthread_mutex_lock(&ctx->mutex);
+    const char* err = load_checkpoint(ctx, fp, workload);
+    pthread_mutex_unlock(&ctx->mutex);
+    fclose(fp);
+    if (err != NULL) {
+        TRACE_ERROR("%s: %s\n", path, err);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,214 @@
+#include "api.h"
+#include "scheduler.h"
+#include <ctype.h>
+
+// Settings parsing
+// A config is "key = value" settings, one per line or separated by ',' or
+// ';', '#' starting a comment. The policy's apply function takes the values
+// of one key.
+#define MAX_VALUES MLFQ_MAX_LEVELS
+
+typedef int (*apply_fn)(const char* key, char** words, int count, int line, void* config);
+
+// Apply "key = value" from setting, which is modified
+static int parse_setting(char* setting, int line, const char* name, apply_fn apply, void* config) {
+    char* eq = strchr(setting, '=');
+    if (eq == NULL) {
+        TRACE_ERROR("%s config: line %d: expected key = value\n", name, line);
+        return -1;
+    }
+    *eq = '\0';
+    char* saveptr;
+    char* key = strtok_r(setting, " \t\r", &saveptr);
+    if (key == NULL || strtok_r(NULL, " \t\r", &saveptr) != NULL) {
+        TRACE_ERROR("%s config: line %d: expected key = value\n", name, line);
+        return -1;
+    }
+
+    char* words[MAX_VALUES];
+    int count = 0;
+    for (char* word = strtok_r(eq + 1, " \t\r", &saveptr); word != NULL;
+         word = strtok_r(NULL, " \t\r", &saveptr)) {
+        if (count == MAX_VALUES) {
+            TRACE_ERROR("%s config: line %d: more than %d values\n", name, line, MAX_VALUES);
+            return -1;
+        }
+        words[count++] = word;
+    }
+    if (count == 0) {
+        TRACE_ERROR("%s config: line %d: %s has no value\n", name, line, key);
+        return -1;
+    }
+    return apply(key, words, count, line, config);
+}
+
+static int parse_config(const char* text, const char* name, apply_fn apply, void* config) {
+    char* copy = strdup(text);
+    if (copy == NULL) {
+        perror("strdup() error");
+        exit(EXIT_FAILURE);
+    }
+
+    int ret = 0;
+    int line = 1;
+    char* next = copy;
+    while (ret == 0 && next != NULL) {
+        char* text_line = next;
+        next = strchr(text_line, '\n');
+        if (next != NULL) *next++ = '\0';
+        char* comment = strchr(text_line, '#');
+        if (comment != NULL) *comment = '\0';
+
+        char* saveptr;
+        for (char* setting = strtok_r(text_line, ",;", &saveptr); ret == 0 && setting != NULL;
+             setting = strtok_r(NULL, ",;", &saveptr)) {
+            // Blank settings are allowed
+            while (isspace((unsigned char)*setting)) setting++;
+            if (*setting != '\0') ret = parse_setting(setting, line, name, apply, config);
+        }
+        line++;
+    }
+    free(copy);
+    return ret;
+}
+
+// Whole file as a string, NULL if it cannot be read
+static char* read_config(const char* path, const char* name) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        TRACE_ERROR("%s config: cannot open %s\n", name, path);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    char* text = checked_realloc(NULL, size + 1);
+    size_t len = fread(text, 1, size, fp);
+    text[len] = '\0';
+    fclose(fp);
+    return text;
+}
+
+// MLFQ configuration parsing
+
+void mlfq_default_config(struct sch_mlfq_config* config) {
+    config->levels = 5;
+    for (int i = 0; i < MLFQ_MAX_LEVELS; i++) {
+        config->quantum[i] = 5 * (i + 1);
+        config->discipline[i] = MLFQ_RR;
+    }
+    config->boost_interval = 0;
+}
+
+// Parse one MLFQ value of key, returns false if it is not valid
+static bool parse_value(const char* key, const char* word, int* out) {
+    if (strcmp(key, "discipline") == 0) {
+        if (strcmp(word, "rr") == 0) {
+            *out = MLFQ_RR;
+        } else if (strcmp(word, "fcfs") == 0) {
+            *out = MLFQ_FCFS;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    // A boost interval of 0 turns boosting off, everything else is positive
+    long min = strcmp(key, "boost") == 0 ? 0 : 1;
+    char* end;
+    long value = strtol(word, &end, 10);
+    if (*end != '\0' || value < min || value > INT_MAX) return false;
+    *out = (int)value;
+    return true;
+}
+
+static int apply_mlfq(const char* key, char** words, int count, int line, void* arg) {
+    struct sch_mlfq_config* config = arg;
+    int values[MAX_VALUES];
+    for (int i = 0; i < count; i++) {
+        if (!parse_value(key, words[i], &values[i])) {
+            TRACE_ERROR("mlfq config: line %d: invalid %s value '%s'\n", line, key, words[i]);
+            return -1;
+        }
+    }
+
+    if (strcmp(key, "levels") == 0) {
+        if (count != 1 || values[0] > MLFQ_MAX_LEVELS) {
+            TRACE_ERROR("mlfq config: line %d: levels must be 1 to %d\n", line, MLFQ_MAX_LEVELS);
+            return -1;
+        }
+        config->levels = values[0];
+    } else if (strcmp(key, "boost") == 0) {
+        if (count != 1) {
+            TRACE_ERROR("mlfq config: line %d: boost takes one value\n", line);
+            return -1;
+        }
+        config->boost_interval = values[0];
+    } else if (strcmp(key, "quantum") == 0 || strcmp(key, "discipline") == 0) {
+        // The last value covers the remaining levels
+        bool quantum = key[0] == 'q';
+        for (int i = 0; i < MLFQ_MAX_LEVELS; i++) {
+            int value = values[i < count ? i : count - 1];
+            if (quantum) {
+                config->quantum[i] = value;
+            } else {
+                config->discipline[i] = (enum mlfq_discipline)value;
+            }
+        }
+    } else {
+        TRACE_ERROR("mlfq config: line %d: unknown key '%s'\n", line, key);
+        return -1;
+    }
+    return 0;
+}
+
+int mlfq_parse_config(const char* text, struct sch_mlfq_config* config) {
+    return parse_config(text, "mlfq", apply_mlfq, config);
+}
+
+int mlfq_load_config(const char* path, struct sch_mlfq_config* config) {
+    char* text = read_config(path, "mlfq");
+    if (text == NULL) return -1;
+    int ret = mlfq_parse_config(text, config);
+    free(text);
+    return ret;
+}
+
+// CFS configuration parsing
+
+void cfs_default_config(struct sch_cfs_config* config) {
+    config->target_latency = 20;
+    config->min_granularity = 4;
+}
+
+static int apply_cfs(const char* key, char** words, int count, int line, void* arg) {
+    struct sch_cfs_config* config = arg;
+    int* field;
+    if (strcmp(key, "latency") == 0) {
+        field = &config->target_latency;
+    } else if (strcmp(key, "granularity") == 0) {
+        field = &config->min_granularity;
+    } else {
+        TRACE_ERROR("cfs config: line %d: unknown key '%s'\n", line, key);
+        return -1;
+    }
+    char* end;
+    long value = strtol(words[0], &end, 10);
+    if (count != 1 || *end != '\0' || value < 1 || value > INT_MAX) {
+        TRACE_ERROR("cfs config: line %d: %s takes one positive value\n", line, key);
+        return -1;
+    }
+    *field = (int)value;
+    return 0;
+}
+
+int cfs_parse_config(const char* text, struct sch_cfs_config* config) {
+    return parse_config(text, "cfs", apply_cfs, config);
+}
+
+int cfs_load_config(const char* path, struct sch_cfs_config* config) {
+    char* text = read_config(path, "cfs");
+    if (text == NULL) return -1;
+    int ret = cfs_parse_config(text, config);
+    free(text);
+    return ret;
+}
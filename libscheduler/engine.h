@@ -0,0 +1,178 @@
+// Simulation loop of one policy
+// scheduler.c includes this once per policy with POLICY set to its prefix,
+// so every built-in policy gets its own copy of the dispatch code calling
+// its operations directly, see policy.c. Which copy runs is chosen once per
+// run in set_simulation(). No include guard on purpose.
+
+#ifndef POLICY
+#error "POLICY must be defined before including engine.h"
+#endif
+
+#define ENGINE_CAT(a, b) a##_##b
+#define ENGINE_PASTE(a, b) ENGINE_CAT(a, b)
+#define OP(name) ENGINE_PASTE(POLICY, name)       // policy operation
+#define ENGINE(name) ENGINE_PASTE(name, POLICY)   // this policy's copy
+
+// Ready threads of the core that are not running
+static int ENGINE(core_waiting)(sched_ctx_t* ctx, core_t* core) {
+    int count = OP(count)(ctx, core);
+    if (core->current != NULL && OP(queued)(ctx, core, core->current)) count--;
+    return count;
+}
+
+// Core for a thread that has not been placed yet
+static int ENGINE(least_loaded_core)(sched_ctx_t* ctx) {
+    int best = 0;
+    int best_load = INT_MAX;
+    for (int i = 0; i < ctx->core_count; i++) {
+        int load = ENGINE(core_waiting)(ctx, &ctx->cores[i]) + (ctx->cores[i].current != NULL);
+        if (load < best_load) {
+            best = i;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+// Take the thread the busiest other core would run next and move it to core
+static thread_control_block_t* ENGINE(steal_thread)(sched_ctx_t* ctx, core_t* core) {
+    core_t* victim = NULL;
+    int victim_waiting = 0;
+    for (int i = 0; i < ctx->core_count; i++) {
+        int waiting = ENGINE(core_waiting)(ctx, &ctx->cores[i]);
+        if (&ctx->cores[i] != core && waiting > victim_waiting) {
+            victim = &ctx->cores[i];
+            victim_waiting = waiting;
+        }
+    }
+    if (victim == NULL) return NULL;
+
+    // The victim's running thread is not up for grabs
+    thread_control_block_t* tcb = OP(pick_except)(ctx, victim, victim->current);
+    if (tcb == NULL) return NULL;
+
+    OP(on_block)(ctx, victim, tcb);
+    tcb->core = core->id;
+    OP(enqueue)(ctx, core, tcb);
+    TRACE_EVENT(TRACE_STEAL, tcb->tid, ctx->global_time, victim->id, core->id);
+    return tcb;
+}
+
+static void ENGINE(grant_cpu_tick)(core_t* core, thread_control_block_t* tcb) {
+    sched_ctx_t* ctx = tcb->ctx;
+    int tid = tcb->tid;
+    int penalty = (tcb->last_core != -1 && tcb->last_core != core->id) ? ctx->migration_cost : 0;
+    int64_t end_time = ctx->global_time + penalty + 1;
+    core->current = tcb;
+    tcb->last_core = core->id;
+    int level = ctx->mlfq_data[tcb->slot].level;
+    TRACE_EVENT(TRACE_DISPATCH, tid, ctx->global_time, tcb->remaining_time, level);
+    metrics_dispatch(ctx, core->id, tcb->slot, ctx->global_time, level, end_time - ctx->global_time);
+    emit_event(SCH_EVENT_DISPATCH, tcb, ctx->global_time, end_time, -1);
+
+    tcb->state = STATE_RUNNING;
+    tcb->remaining_time--;
+    tcb->last_cpu_remaining = tcb->remaining_time;
+    OP(on_tick)(ctx, core, tcb);
+    release_thread(tcb, end_time);
+}
+
+// Hand every idle core a thread for the current tick, returns false if none
+// was dispatched. Cores first run their own queue, then the ones left idle
+// steal, so a thread is never taken from the core that would run it now.
+static bool ENGINE(dispatch_idle_cores)(sched_ctx_t* ctx) {
+    bool dispatched = false;
+    for (int i = 0; i < ctx->core_count; i++) {
+        if (ctx->cores[i].current != NULL) continue;
+        thread_control_block_t* tcb = OP(pick_next)(ctx, &ctx->cores[i]);
+        if (tcb != NULL) {
+            ENGINE(grant_cpu_tick)(&ctx->cores[i], tcb);
+            dispatched = true;
+        }
+    }
+    if (ctx->core_count == 1) return dispatched;
+
+    for (int i = 0; i < ctx->core_count; i++) {
+        if (ctx->cores[i].current != NULL) continue;
+        thread_control_block_t* tcb = ENGINE(steal_thread)(ctx, &ctx->cores[i]);
+        if (tcb != NULL) {
+            ENGINE(grant_cpu_tick)(&ctx->cores[i], tcb);
+            dispatched = true;
+        }
+    }
+    return dispatched;
+}
+
+static void ENGINE(process_cpu)(thread_control_block_t* tcb) {
+    sched_ctx_t* ctx = tcb->ctx;
+    int remaining_time = tcb->op_arg;
+    metrics_arrive(ctx, tcb->slot, tcb->op_time);
+    TRACE_EVENT(TRACE_CALL_CPU, tcb->tid, ctx->global_time, remaining_time, 0);
+
+    // CPU burst ended for the thread.
+    if (remaining_time == 0) {
+        if (tcb->core != -1) OP(on_block)(ctx, &ctx->cores[tcb->core], tcb);
+        release_thread(tcb, ctx->global_time);
+        return;
+    }
+
+    if (tcb->core == -1) {
+        tcb->core = ENGINE(least_loaded_core)(ctx);
+    }
+
+    // A new burst happens at start or after I/O / semaphore calls.
+    bool new_burst = (tcb->last_cpu_remaining <= 0 || remaining_time > tcb->last_cpu_remaining);
+    if (new_burst) {
+        tcb->ready_time = tcb->op_time;
+    }
+    tcb->remaining_time = remaining_time;
+    tcb->state = STATE_READY;
+    metrics_ready(ctx, tcb->slot, ctx->global_time);
+
+    if (new_burst) OP(on_wake)(ctx, tcb);
+    OP(enqueue)(ctx, &ctx->cores[tcb->core], tcb);
+}
+
+// Advance the simulation as far as the published operations allow.
+// Must be called with ctx->mutex held.
+void ENGINE(run_simulation)(sched_ctx_t* ctx) {
+    while (true) {
+        // A returned thread may still publish an operation for the current tick
+        if (atomic_load_explicit(&ctx->unpublished_count, memory_order_acquire) > 0) return;
+        collect_published_ops(ctx);
+        // A thread arriving now makes its first call before this tick goes on
+        if (admit_arrivals(ctx)) continue;
+
+        thread_control_block_t* next = heap_peek(&ctx->event_queue);
+        if (next != NULL && next->event_time <= ctx->global_time) {
+            heap_pop(&ctx->event_queue);
+            if (next->event_type == EVENT_RELEASE) {
+                complete_event(next);
+            } else if (next->op == OP_CPU) {
+                ENGINE(process_cpu)(next);
+            } else {
+                process_op(next);
+            }
+            continue;
+        }
+
+        // Every operation for this tick is known. Devices go first, a
+        // zero-length I/O returns in time to compete for the CPUs.
+        OP(on_time)(ctx);
+        if (dispatch_idle_devices(ctx)) continue;
+        if (ENGINE(dispatch_idle_cores)(ctx)) continue;
+
+        // Nothing left for this tick, on to the next event or arrival
+        int64_t arrival = next_arrival(ctx);
+        if (next == NULL && arrival == INT64_MAX) return;
+        advance_time_to(ctx, (next != NULL && next->event_time < arrival) ? next->event_time : arrival);
+        // Every thread is in a call here, see checkpoint.c
+        if (ctx->global_time >= ctx->checkpoint_time) write_checkpoint(ctx);
+    }
+}
+
+#undef ENGINE_CAT
+#undef ENGINE_PASTE
+#undef OP
+#undef ENGINE
+#undef POLICY
@@ -0,0 +1,235 @@
+#include "api.h"
+#include "scheduler.h"
+#include <ucontext.h>
+
+// Fiber execution mode
+// Every simulated thread runs as a user-space fiber with its own stack. A
+// small pool of OS threads (workers) resumes fibers whose call returned, so a
+// simulated context switch is a swapcontext() instead of a kernel switch.
+//
+// Fibers are not tied to threads: a thread gets an idle fiber when it starts
+// and the fiber goes back to the idle ones once it returned from entry, so a
+// stream run needs only as many stacks as threads are alive at once.
+//
+// Locking: the pool mutex guards the run queue, the idle fibers and the
+// released/parked flags of fibers. A fiber parks while holding the mutex and the worker that resumed
+// it continues with the mutex held. A worker resuming a parked fiber holds the
+// mutex so the fiber returns into fiber_wait() exactly as if a condition
+// variable wait had returned. The simulation takes the pool mutex inside
+// ctx->mutex to wake a fiber. Every scheduler instance has its own pool.
+
+struct fiber {
+    ucontext_t context;
+    ucontext_t* worker_context;   // worker to switch back to when parking
+    void* stack;
+    int tid;        // thread the fiber runs
+    bool started;
+    bool parked;    // waiting in fiber_park() for its call to return
+    bool finished;  // returned from entry, the stack is free once switched out
+};
+
+typedef struct fiber fiber_t;
+
+// Pool and fiber of the worker running on this OS thread, read by a fiber as
+// it starts. Fibers move between workers, so they are not read later.
+static __thread fiber_pool_t* worker_pool = NULL;
+static __thread fiber_t* worker_fiber = NULL;
+
+static void fiber_trampoline(void) {
+    fiber_pool_t* pool = worker_pool;
+    fiber_t* f = worker_fiber;
+    pool->entry(f->tid, pool->arg);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->left--;
+    if (pool->left == 0) {
+        pthread_cond_broadcast(&pool->cond);
+    }
+    // Never resumed, the worker hands the stack to the next thread
+    f->finished = true;
+    swapcontext(&f->context, f->worker_context);
+}
+
+static void* fiber_worker(void* arg) {
+    fiber_pool_t* pool = (fiber_pool_t*)arg;
+    ucontext_t worker_context;
+    worker_pool = pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+        while (pool->run_queue.count == 0 && pool->left > 0) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        if (pool->left == 0) break;
+
+        thread_control_block_t* tcb = dequeue(&pool->run_queue);
+        fiber_t* f = tcb->fiber;
+        f->worker_context = &worker_context;
+        if (!f->started) {
+            // A fresh fiber starts in user code, outside the library
+            f->started = true;
+            worker_fiber = f;
+            pthread_mutex_unlock(&pool->mutex);
+        }
+        swapcontext(&worker_context, &f->context);
+        // Back with the pool mutex held: the fiber parked or finished
+        if (f->finished) pool->idle[pool->idle_count++] = f;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+// Called from publish_op(), returns once the call has been released
+void fiber_wait(thread_control_block_t* tcb) {
+    fiber_pool_t* pool = &tcb->ctx->fibers;
+    fiber_t* f = tcb->fiber;
+    pthread_mutex_lock(&pool->mutex);
+    while (!tcb->released) {
+        f->parked = true;
+        swapcontext(&f->context, f->worker_context);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Called from the scheduler with ctx->mutex held
+// A fiber released while it is still running simply does not park.
+void fiber_wake(thread_control_block_t* tcb) {
+    fiber_pool_t* pool = &tcb->ctx->fibers;
+    fiber_t* f = tcb->fiber;
+    pthread_mutex_lock(&pool->mutex);
+    tcb->released = true;
+    if (f->parked) {
+        f->parked = false;
+        enqueue(&pool->run_queue, tcb);
+        pthread_cond_signal(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void init_fiber_pool(fiber_pool_t* pool) {
+    pool->active = false;
+    pool->fibers = NULL;
+    pool->count = 0;
+    pool->capacity = 0;
+    pool->idle = NULL;
+    pool->idle_count = 0;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    init_queue(&pool->run_queue);
+    pool->left = 0;
+    pool->entry = NULL;
+    pool->arg = NULL;
+}
+
+void free_fiber_pool(fiber_pool_t* pool) {
+    for (int i = 0; i < pool->count; i++) {
+        free(pool->fibers[i]->stack);
+        free(pool->fibers[i]);
+    }
+    free(pool->fibers);
+    free(pool->idle);
+    pool->fibers = NULL;
+    pool->idle = NULL;
+    pool->count = 0;
+    pool->capacity = 0;
+    pool->idle_count = 0;
+    free_queue(&pool->run_queue);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+}
+
+// Run tcb's thread on an idle fiber, a new one if there is none. Fibers are
+// allocated one by one, a parked fiber's context must not move.
+void start_fiber(fiber_pool_t* pool, thread_control_block_t* tcb) {
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->idle_count == 0) {
+        if (pool->count == pool->capacity) {
+            pool->capacity = pool->capacity > 0 ? pool->capacity * 2 : 16;
+            pool->fibers = checked_realloc(pool->fibers, sizeof(*pool->fibers) * pool->capacity);
+            pool->idle = checked_realloc(pool->idle, sizeof(*pool->idle) * pool->capacity);
+        }
+        fiber_t* f = checked_realloc(NULL, sizeof(fiber_t));
+        f->stack = checked_realloc(NULL, FIBER_STACK_SIZE);
+        pool->fibers[pool->count++] = f;
+        pool->idle[pool->idle_count++] = f;
+    }
+    fiber_t* f = pool->idle[--pool->idle_count];
+    f->tid = tcb->tid;
+    f->started = false;
+    f->parked = false;
+    f->finished = false;
+    f->worker_context = NULL;
+    getcontext(&f->context);
+    f->context.uc_stack.ss_sp = f->stack;
+    f->context.uc_stack.ss_size = FIBER_STACK_SIZE;
+    f->context.uc_link = NULL;
+    makecontext(&f->context, fiber_trampoline, 0);
+    tcb->fiber = f;
+    enqueue(&pool->run_queue, tcb);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Start a run of thread_count threads, the stacks of earlier runs are reused
+static void begin_fibers(fiber_pool_t* pool, int thread_count, fiber_entry_fn entry, void* arg) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->active = true;
+    pool->entry = entry;
+    pool->arg = arg;
+    pool->left = thread_count;
+    clear_queue(&pool->run_queue);
+    for (int i = 0; i < pool->count; i++) {
+        pool->idle[i] = pool->fibers[i];
+    }
+    pool->idle_count = pool->count;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Run the fibers on worker_count OS threads until every thread returned
+static void run_workers(fiber_pool_t* pool, int worker_count) {
+    if (worker_count < 1) worker_count = 1;
+    pthread_t* workers = checked_realloc(NULL, sizeof(pthread_t) * worker_count);
+    for (int i = 0; i < worker_count; i++) {
+        if (pthread_create(&workers[i], NULL, fiber_worker, pool)) {
+            perror("pthread_create() error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->active = false;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void sched_run_fibers(sched_ctx_t* ctx, int worker_count, fiber_entry_fn entry, void* arg) {
+    fiber_pool_t* pool = &ctx->fibers;
+    begin_fibers(pool, ctx->thread_count, entry, arg);
+    for (int i = 0; i < ctx->thread_count; i++) {
+        start_fiber(pool, ctx->threads[i]);
+    }
+    run_workers(pool, worker_count);
+}
+
+// Fiber body of a stream run
+static void stream_thread(int tid, void* arg) {
+    sched_ctx_t* ctx = (sched_ctx_t*)arg;
+    sched_replay_thread(ctx, ctx->stream.workload, tid);
+}
+
+// The simulation starts the first threads, the rest are started as the
+// threads already running move it forward, see admit_arrivals()
+void sched_run_stream(sched_ctx_t* ctx, int worker_count, const struct sch_workload* workload) {
+    fiber_pool_t* pool = &ctx->fibers;
+    begin_fibers(pool, workload->thread_count, stream_thread, ctx);
+
+    pthread_mutex_lock(&ctx->mutex);
+    begin_stream(ctx, workload);
+    ctx->simulate(ctx);
+    pthread_mutex_unlock(&ctx->mutex);
+
+    run_workers(pool, worker_count);
+}
@@ -2,67 +2,224 @@
 #include "scheduler.h"
 #include <stdbool.h>
 
+sched_ctx_t* default_ctx = NULL;
+
 void init_scheduler(enum sch_type type, int count) {
-    pthread_mutex_lock(&scheduler_mutex);
-    
-    scheduler_type = type;
-    thread_count = count;
-    active_threads = count;
-    arrived_count = 0;
-    global_time = 0;
-    global_IO_time = 0;
-    blocked_on_p_count = 0;
-
-    tcb_array = malloc(sizeof(thread_control_block_t) * thread_count);
-    for (int i = 0; i < thread_count; i++) {
-        tcb_array[i].tid = i;
-        tcb_array[i].state = STATE_READY;
-        tcb_array[i].last_cpu_remaining = -1;
-        tcb_array[i].ready_arrival_tick = 0;
-        tcb_array[i].wake_time = 0;
-        pthread_cond_init(&tcb_array[i].cond, NULL);
-    }    
-    init_queue(&ready_queue);
-    init_queue(&io_queue);
-
-    // Initialize MLFQ queues
-    for (int i = 0; i < 5; i++) {
-        init_queue(&mlfq[i]);
+    init_scheduler_smp(type, count, 1, 0);
+}
+
+void init_scheduler_smp(enum sch_type type, int count, int cpu_count, int cost) {
+    default_ctx = sched_create(type, count, cpu_count, cost);
+}
+
+void finish_scheduler() {
+    sched_finish(default_ctx);
+    sched_destroy(default_ctx);
+    default_ctx = NULL;
+}
+
+sched_ctx_t* sched_create(enum sch_type type, int count, int cpu_count, int cost) {
+    sched_ctx_t* ctx = checked_realloc(NULL, sizeof(sched_ctx_t));
+    memset(ctx, 0, sizeof(*ctx));
+    pthread_mutex_init(&ctx->mutex, NULL);
+    init_heap(&ctx->event_queue, HEAP_SLOT_EVENT, event_less);
+    init_fiber_pool(&ctx->fibers);
+    init_stream(&ctx->stream);
+    sched_reset(ctx, type, count, cpu_count, cost);
+    return ctx;
+}
+
+// Use device_count devices, keeping the request heaps of earlier ones.
+// Called with ctx->mutex held.
+void set_io_devices(sched_ctx_t* ctx, int device_count, const enum io_discipline* disciplines) {
+    if (device_count < 1) device_count = 1;
+    if (device_count > ctx->io_device_capacity) {
+        ctx->io_devices = checked_realloc(ctx->io_devices, sizeof(io_device_t) * device_count);
+        for (int i = ctx->io_device_capacity; i < device_count; i++) {
+            init_heap(&ctx->io_devices[i].requests, HEAP_SLOT_WAIT, io_fifo_less);
+        }
+        ctx->io_device_capacity = device_count;
     }
+    ctx->io_device_count = device_count;
+    for (int i = 0; i < device_count; i++) {
+        init_io_device(&ctx->io_devices[i], i, disciplines ? disciplines[i] : IO_FIFO);
+    }
+}
+
+// Make room for count slots. TCBs are allocated one by one, so the ones
+// queued or on the calendar do not move when a stream run grows the arrays.
+void reserve_slots(sched_ctx_t* ctx, int count) {
+    if (count <= ctx->thread_capacity) return;
+    int capacity = ctx->thread_capacity > 0 ? ctx->thread_capacity : 16;
+    while (capacity < count) capacity *= 2;
+    ctx->threads = checked_realloc(ctx->threads, sizeof(*ctx->threads) * capacity);
+    for (int i = ctx->thread_capacity; i < capacity; i++) {
+        thread_control_block_t* tcb = checked_realloc(NULL, sizeof(thread_control_block_t));
+        pthread_mutex_init(&tcb->lock, NULL);
+        pthread_cond_init(&tcb->cond, NULL);
+        ctx->threads[i] = tcb;
+    }
+    ctx->mlfq_data = checked_realloc(ctx->mlfq_data, sizeof(mlfq_info_t) * capacity);
+    ctx->cfs_data = checked_realloc(ctx->cfs_data, sizeof(cfs_info_t) * capacity);
+    ctx->thread_capacity = capacity;
+}
+
+// Set up slot for thread tid before its first call
+void init_thread(sched_ctx_t* ctx, int slot, int tid) {
+    thread_control_block_t* tcb = ctx->threads[slot];
+    tcb->ctx = ctx;
+    tcb->tid = tid;
+    tcb->slot = slot;
+    tcb->state = STATE_READY;
+    tcb->last_cpu_remaining = -1;
+    tcb->ready_time = 0;
+    tcb->op = OP_NONE;
+    tcb->released = false;
+    tcb->heap_pos[HEAP_SLOT_EVENT] = -1;
+    tcb->heap_pos[HEAP_SLOT_READY] = -1;
+    tcb->heap_pos[HEAP_SLOT_WAIT] = -1;
+    tcb->io_device = 0;
+    tcb->core = -1;
+    tcb->last_core = -1;
+    tcb->fiber = NULL;
+    tcb->replay_op = UINT64_MAX;
+    tcb->replay_left = 0;
+    tcb->resume = false;
+
+    ctx->mlfq_data[slot].level = 0;
+    ctx->mlfq_data[slot].quantum_used = 0;
+    ctx->cfs_data[slot].vruntime = 0;
+    ctx->cfs_data[slot].weight = CFS_NICE_0_WEIGHT;
+    ctx->cfs_data[slot].core = -1;
+    ctx->cfs_data[slot].waking = false;
+}
+
+void sched_reset(sched_ctx_t* ctx, enum sch_type type, int count, int cpu_count, int cost) {
+    pthread_mutex_lock(&ctx->mutex);
+
+    trace_init();
+    metrics_init(ctx, count);
 
-    // Initialize per-thread MLFQ metadata
-    for (int i = 0; i < MAX_THREADS; i++) {
-        mlfq_data[i].level = 0;
-        mlfq_data[i].quantum_used = 0;
+    ctx->scheduler_type = type;
+    ctx->migration_cost = cost > 0 ? cost : 0;
+    ctx->thread_count = count;
+    atomic_store(&ctx->unpublished_count, count);  // every thread starts outside the library
+    atomic_store(&ctx->published_ops, NULL);
+    ctx->global_time = 0;
+    ctx->io_request_seq = 0;
+    ctx->event_seq = 0;
+
+    // Slot i holds thread i
+    reserve_slots(ctx, count);
+    ctx->slot_count = count;
+    for (int i = 0; i < count; i++) {
+        init_thread(ctx, i, i);
     }
+    ctx->stream.workload = NULL;
+
+    clear_heap(&ctx->event_queue);
+
+    // One FIFO device until configure_io_devices()
+    set_io_devices(ctx, 1, NULL);
 
-    for (int i = 0; i < MAX_NUM_SEM; i++) {
-        semaphores[i].value = 0;
-        semaphores[i].blocked_count = 0;
-        pthread_mutex_init(&semaphores[i].mutex, NULL);
-        pthread_cond_init(&semaphores[i].cond, NULL);
+    // Each core has the run queues of every built-in policy
+    if (cpu_count < 1) cpu_count = 1;
+    if (cpu_count > ctx->core_capacity) {
+        ctx->cores = checked_realloc(ctx->cores, sizeof(core_t) * cpu_count);
+        for (int c = ctx->core_capacity; c < cpu_count; c++) {
+            init_queue(&ctx->cores[c].ready_queue);
+            init_heap(&ctx->cores[c].srtf_heap, HEAP_SLOT_READY, srtf_less);
+            for (int i = 0; i < MLFQ_MAX_LEVELS; i++) {
+                init_heap(&ctx->cores[c].mlfq[i], HEAP_SLOT_READY, mlfq_less);
+            }
+            init_heap(&ctx->cores[c].cfs_heap, HEAP_SLOT_READY, cfs_less);
+        }
+        ctx->core_capacity = cpu_count;
     }
-    
-    current_cpu_thread = NULL;
-    current_io_thread = NULL;
-    
-    pthread_mutex_unlock(&scheduler_mutex);
+    ctx->core_count = cpu_count;
+    for (int c = 0; c < cpu_count; c++) {
+        core_t* core = &ctx->cores[c];
+        core->id = c;
+        core->current = NULL;
+        clear_queue(&core->ready_queue);
+        clear_heap(&core->srtf_heap);
+        for (int i = 0; i < MLFQ_MAX_LEVELS; i++) {
+            clear_heap(&core->mlfq[i]);
+        }
+        core->mlfq_bitmap = 0;
+        clear_heap(&core->cfs_heap);
+        core->min_vruntime = 0;
+        core->cfs_load = 0;
+        core->cfs_curr = NULL;
+        core->slice_used = 0;
+    }
+
+    // Default MLFQ levels and CFS periods until configure_mlfq() and
+    // configure_cfs()
+    mlfq_default_config(&ctx->mlfq);
+    ctx->next_boost = 0;
+    cfs_default_config(&ctx->cfs);
+
+    // The built-in policy until set_policy()
+    drop_policy(ctx);
+    set_simulation(ctx);
+
+    // Semaphores are created on first use
+    clear_semaphores(&ctx->semaphores);
+
+    // No checkpoint until checkpoint_at()
+    ctx->checkpoint_time = INT64_MAX;
+    free(ctx->checkpoint_path);
+    ctx->checkpoint_path = NULL;
+
+    pthread_mutex_unlock(&ctx->mutex);
 }
 
-void finish_scheduler() {
-    pthread_mutex_lock(&scheduler_mutex);
-    
-    for (int i = 0; i < thread_count; i++) {
-        pthread_cond_destroy(&tcb_array[i].cond);
+void sched_finish(sched_ctx_t* ctx) {
+    pthread_mutex_lock(&ctx->mutex);
+
+    metrics_write(ctx);
+    drop_policy(ctx);
+    ctx->event_listener = NULL;
+    ctx->event_listener_arg = NULL;
+    trace_finish();
+
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+void sched_destroy(sched_ctx_t* ctx) {
+    drop_policy(ctx);
+    for (int i = 0; i < ctx->thread_capacity; i++) {
+        pthread_mutex_destroy(&ctx->threads[i]->lock);
+        pthread_cond_destroy(&ctx->threads[i]->cond);
+        free(ctx->threads[i]);
+    }
+
+    free_semaphores(&ctx->semaphores);
+
+    for (int i = 0; i < ctx->io_device_capacity; i++) {
+        free_heap(&ctx->io_devices[i].requests);
     }
-    
-    for (int i = 0; i < MAX_NUM_SEM; i++) {
-        pthread_mutex_destroy(&semaphores[i].mutex);
-        pthread_cond_destroy(&semaphores[i].cond);
+    free(ctx->io_devices);
+    free_heap(&ctx->event_queue);
+    for (int c = 0; c < ctx->core_capacity; c++) {
+        free_queue(&ctx->cores[c].ready_queue);
+        free_heap(&ctx->cores[c].srtf_heap);
+        for (int i = 0; i < MLFQ_MAX_LEVELS; i++) {
+            free_heap(&ctx->cores[c].mlfq[i]);
+        }
+        free_heap(&ctx->cores[c].cfs_heap);
     }
-    
-    free(tcb_array);
-    tcb_array = NULL;
-    
-    pthread_mutex_unlock(&scheduler_mutex);
-}
\ No newline at end of file
+    free(ctx->cores);
+
+    free(ctx->mlfq_data);
+    free(ctx->cfs_data);
+    free(ctx->threads);
+    free_stream(&ctx->stream);
+
+    metrics_free(ctx);
+    free_fiber_pool(&ctx->fibers);
+    free(ctx->checkpoint_path);
+    pthread_mutex_destroy(&ctx->mutex);
+    free(ctx);
+}
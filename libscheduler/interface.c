@@ -4,324 +4,194 @@
 #include <stdio.h>
 
 // Interface implementation
-// Implement APIs here...
+// Every call publishes its operation without taking a lock and sleeps until
+// the simulation reaches it, see publish() and engine.h.
 
-int cpu_me(float current_time, int tid, int remaining_time) {
-    pthread_mutex_lock(&scheduler_mutex);
-    printf("CPU called for tid:%d called at time: %f\n", tid, current_time);
-
-    thread_control_block_t* tcb = &tcb_array[tid];
-    tcb->remaining_time = remaining_time;
-    
-    // CPU burst ended for the thread.
-    if (remaining_time == 0) {
-        int int_time = ceil(current_time);
-        
-        if (scheduler_type == SCH_FCFS || scheduler_type == SCH_SRTF) {
-            dequeue_tid_from_q(&ready_queue, tid);
-        } else {
-            dequeue_tid_from_q(&mlfq[mlfq_data[tid].level], tid);
-        }
-
-        pthread_mutex_unlock(&scheduler_mutex);
-        return int_time;
-    }
+sch_time_t sched_cpu_me(sched_ctx_t* ctx, sch_time_t current_time, int tid, int remaining_time) {
+    thread_control_block_t* tcb = find_thread(ctx, tid);
+    return publish_op(tcb, OP_CPU, current_time, remaining_time);
+}
 
-    if (scheduler_type == SCH_FCFS) {
-        // A new burst happens at start or afterwards.
-        bool new_burst = (tcb->last_cpu_remaining <= 0 || remaining_time > tcb->last_cpu_remaining);
-        if (new_burst) {
-            tcb->ready_arrival_tick = current_time;
-            if (current_cpu_thread == tcb) {
-                current_cpu_thread = NULL;
-            }
-        }
-    } else if (scheduler_type == SCH_SRTF) {
-        tcb->ready_arrival_tick = current_time;
-        current_cpu_thread = NULL;
-    } else {
-        // MLFQ handling
-        bool new_burst = (tcb->last_cpu_remaining <= 0 || remaining_time > tcb->last_cpu_remaining);
-        if (new_burst) {
-            printf("new burst detected in cpu me for tid: %d\n", tid);
-            tcb->ready_arrival_tick = current_time;
-            promote_on_new_burst(tcb);
-            current_cpu_thread = NULL;
-        }
-    }
+sch_time_t sched_io_me(sched_ctx_t* ctx, sch_time_t current_time, int tid, int duration) {
+    return sched_io_me_on(ctx, current_time, tid, duration, 0);
+}
 
-    // If this thread isn’t already running on CPU put it in the ready queue. 
-    if (scheduler_type == SCH_FCFS || scheduler_type == SCH_SRTF) {
-        if (current_cpu_thread != tcb) {
-            printf("Enqueued for %d in CPU me\n", tcb->tid);
-            enqueue(&ready_queue, tcb);
-            tcb->state = STATE_READY;
-        }
+sch_time_t sched_io_me_on(sched_ctx_t* ctx, sch_time_t current_time, int tid, int duration, int device) {
+    // The device count is fixed before threads run
+    if (device < 0 || device >= ctx->io_device_count) {
+        TRACE_ERROR("Error: T%d requested I/O device %d of %d, using device 0\n",
+                    tid, device, ctx->io_device_count);
+        device = 0;
     }
+    thread_control_block_t* tcb = find_thread(ctx, tid);
+    tcb->io_device = device;
+    return publish_op(tcb, OP_IO, current_time, duration);
+}
 
-    barrier_wait();
-
-    // Checking if CPU is idle,
-    printf("Barrier crossed for %d in cpu_me\n", tcb->tid);
-    if (current_cpu_thread == NULL) {
-        current_cpu_thread = select_next_thread();
-        if (current_cpu_thread != NULL) {
-            printf("current_cpu_thread is allocated to %d in cpu_me\n", current_cpu_thread->tid);
-            current_cpu_thread->state = STATE_RUNNING;
-            pthread_cond_signal(&current_cpu_thread->cond);
-        }
-    }
-    
-    // If this thread wasn’t chosen, it sleeps until the scheduler signals it.
-    // Guarantees only one thread runs at a time.
-    if (current_cpu_thread != tcb) {
-        printf("%d thread is waiting in Cpu_me for signal\n", tcb->tid);
-        // printf("Current CPU thread at this moment: %d\n",current_cpu_thread->tid);
-        pthread_cond_wait(&tcb->cond, &scheduler_mutex);
-    }
-    printf("%d thread got the signal in cpu_me\n", tid);
-
-    int int_time = ceil(current_time);
-    advance_time_to(int_time);
-    
-    int return_time = global_time + 1;
-    advance_time_to(return_time);
-    if (tcb->remaining_time > 0) tcb->remaining_time--;
-    tcb->last_cpu_remaining = tcb->remaining_time;
-
-    if (scheduler_type == SCH_SRTF) {
-        dequeue_tid_from_q(&ready_queue, tid);
-    } else if (scheduler_type == SCH_MLFQ) {
-        int tid = tcb->tid;
-        mlfq_data[tid].quantum_used++;
-    
-        int lvl = mlfq_data[tid].level;
-        int quantum = MLFQ_TIME_QUANTUM[lvl];
-    
-        // If thread used full quantum (and still not done), demote
-        if (mlfq_data[tid].quantum_used >= quantum && tcb->remaining_time > 0) {
-            dequeue_tid_from_q(&mlfq[lvl], tid);
-            tcb->ready_arrival_tick = current_time;
-            demote_mlfq_thread(tcb);
-            if (current_cpu_thread == tcb) current_cpu_thread = NULL;
-        }
-    }
-    
-    arrived_count--;
-    pthread_mutex_unlock(&scheduler_mutex);
-    
-    return return_time;
+sch_time_t sched_P(sched_ctx_t* ctx, sch_time_t current_time, int tid, int sem_id) {
+    // Blocked case: we were woken by V() at an integer time; return that tick
+    thread_control_block_t* tcb = find_thread(ctx, tid);
+    return publish_op(tcb, OP_P, current_time, sem_id);
 }
 
-int io_me(float current_time, int tid, int duration) {
-    pthread_mutex_lock(&scheduler_mutex);
-    printf("io_me called for tid:%d\n", tid); 
-    
-    barrier_wait();
-    
-    printf("Barrier crossed for io_me %d\n", tid);
-    thread_control_block_t* tcb = &tcb_array[tid];
-    
-    // If the current thread was on the CPU, it must give it up before blocking for I/O.
-    if (current_cpu_thread == tcb) {
-        current_cpu_thread = select_next_thread();
-        if (current_cpu_thread != NULL) {
-            printf("current_cpu_thread is allocated to %d in io_me\n", current_cpu_thread->tid);
-            current_cpu_thread->state = STATE_RUNNING;
-            pthread_cond_signal(&current_cpu_thread->cond);
-            printf("%d signaled from io_me to get unblocked\n", current_cpu_thread->tid);
-        }
-    }
-    
-    // enqueue and wait for your turn
-    enqueue(&io_queue, tcb);
-    tcb->state = STATE_BLOCKED_IO;
-
-    // If device is idle and this thread is at head, start it
-    if (current_io_thread == NULL && peek(&io_queue) == tcb) {
-        current_io_thread = tcb;
-        pthread_cond_signal(&tcb->cond);
+sch_time_t sched_V(sched_ctx_t* ctx, sch_time_t current_time, int tid, int sem_id) {
+    thread_control_block_t* tcb = find_thread(ctx, tid);
+    return publish_op(tcb, OP_V, current_time, sem_id);
+}
+
+void sched_end_me(sched_ctx_t* ctx, int tid) {
+    // A terminated thread never publishes again, let the others move on.
+    thread_control_block_t* tcb = find_thread(ctx, tid);
+    tcb->op = OP_END;
+    publish(tcb);
+}
+
+void sched_set_event_listener(sched_ctx_t* ctx, sch_event_fn listener, void* arg) {
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->event_listener = listener;
+    ctx->event_listener_arg = arg;
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+void sched_configure_io_devices(sched_ctx_t* ctx, int device_count, const enum io_discipline* disciplines) {
+    pthread_mutex_lock(&ctx->mutex);
+    set_io_devices(ctx, device_count, disciplines);
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+void sched_configure_mlfq(sched_ctx_t* ctx, const struct sch_mlfq_config* config) {
+    pthread_mutex_lock(&ctx->mutex);
+
+    ctx->mlfq = *config;
+    if (ctx->mlfq.levels < 1) ctx->mlfq.levels = 1;
+    if (ctx->mlfq.levels > MLFQ_MAX_LEVELS) ctx->mlfq.levels = MLFQ_MAX_LEVELS;
+    for (int i = 0; i < MLFQ_MAX_LEVELS; i++) {
+        if (ctx->mlfq.quantum[i] < 1) ctx->mlfq.quantum[i] = 1;
+        if (ctx->mlfq.discipline[i] != MLFQ_FCFS) ctx->mlfq.discipline[i] = MLFQ_RR;
     }
+    if (ctx->mlfq.boost_interval < 0) ctx->mlfq.boost_interval = 0;
+    ctx->next_boost = ctx->mlfq.boost_interval;
+
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+void sched_configure_cfs(sched_ctx_t* ctx, const struct sch_cfs_config* config) {
+    pthread_mutex_lock(&ctx->mutex);
+
+    ctx->cfs = *config;
+    if (ctx->cfs.target_latency < 1) ctx->cfs.target_latency = 1;
+    if (ctx->cfs.min_granularity < 1) ctx->cfs.min_granularity = 1;
+
+    pthread_mutex_unlock(&ctx->mutex);
+}
 
-    // Wait until we become the active IO thread
-    while (current_io_thread != tcb) {
-        pthread_cond_wait(&tcb->cond, &scheduler_mutex);
-        printf("%d is waiting\n",tcb->tid);
+// A queued thread's weight is part of its core's load
+void sched_set_nice(sched_ctx_t* ctx, int tid, int nice) {
+    pthread_mutex_lock(&ctx->mutex);
+
+    thread_control_block_t* tcb = find_thread(ctx, tid);
+    cfs_info_t* info = &ctx->cfs_data[tcb->slot];
+    int weight = cfs_nice_weight(nice);
+    if (tcb->core != -1 && heap_contains(&ctx->cores[tcb->core].cfs_heap, tcb)) {
+        ctx->cores[tcb->core].cfs_load += weight - info->weight;
     }
+    info->weight = weight;
+
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+void sched_set_policy(sched_ctx_t* ctx, const struct sch_policy* policy) {
+    pthread_mutex_lock(&ctx->mutex);
 
-    int int_time = ceil(current_time);
-    // advance_time_to(int_time);
-
-    // Perform IO for full duration
-    int start_time = 0;
-    if (global_IO_time > int_time) {
-        start_time = global_IO_time;
-    } else {
-        start_time = int_time;
-    } 
-    int io_completion_time = start_time + duration;
-    advance_IO_time_to(io_completion_time);
-
-    // IO complete: pop ourselves from queue and hand cpu to next in the waiting list
-    (void)dequeue(&io_queue); // remove self (at head)
-    current_io_thread = peek(&io_queue);
-    if (current_io_thread) {
-        pthread_cond_signal(&current_io_thread->cond);
+    drop_policy(ctx);
+    if (policy != NULL) {
+        ctx->policy = policy;
+        ctx->policy_state = policy->create ? policy->create(ctx->thread_count, ctx->core_count) : NULL;
     }
+    set_simulation(ctx);
+
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+// Calls on the default instance
+// The call time goes to fixed point and the returned tick back to an int
+
+static sch_time_t to_time(float current_time) {
+    return (sch_time_t)llround((double)current_time * SCH_TIME_FRAC);
+}
 
-    arrived_count--;
+int cpu_me(float current_time, int tid, int remaining_time) {
+    return sched_cpu_me(default_ctx, to_time(current_time), tid, remaining_time) / SCH_TIME_FRAC;
+}
 
-    pthread_mutex_unlock(&scheduler_mutex);
-    
-    return io_completion_time;
+int io_me(float current_time, int tid, int duration) {
+    return sched_io_me_on(default_ctx, to_time(current_time), tid, duration, 0) / SCH_TIME_FRAC;
+}
+
+int io_me_on(float current_time, int tid, int duration, int device) {
+    return sched_io_me_on(default_ctx, to_time(current_time), tid, duration, device) / SCH_TIME_FRAC;
 }
 
 int P(float current_time, int tid, int sem_id) {
-    pthread_mutex_lock(&scheduler_mutex);
-
-    printf("P called for tid:%d\n", tid);
-
-    thread_control_block_t* tcb = &tcb_array[tid];
-    barrier_wait();
-    printf("barrier crossed for tid: %d\n", tid);
-    
-    int int_time = ceil(current_time);
-    
-    
-    // Lock the semaphore's internal varibales
-    pthread_mutex_lock(&semaphores[sem_id].mutex);
-    
-    // semaphore available
-    if (semaphores[sem_id].value > 0) {
-        semaphores[sem_id].value--;
-        advance_time_to(int_time);
-        pthread_mutex_unlock(&semaphores[sem_id].mutex);
-        pthread_mutex_unlock(&scheduler_mutex);
-        // P returns instantly at call’s integer tick
-        return int_time;
-    } else {
-        printf("Sempahore not found for tid: %d in P\n", tid);
-        // Semaphore unavailable therefore blocking
-        // If the thread calling P was running on CPU, it must release CPU.
-        // Scheduler immediately picks another ready thread.
-        if (current_cpu_thread == tcb) {
-            current_cpu_thread = select_next_thread();
-            if (current_cpu_thread != NULL) {
-                current_cpu_thread->state = STATE_RUNNING;
-                pthread_cond_signal(&current_cpu_thread->cond);
-                printf("%d Signaled from P after semaphore is not found\n", current_cpu_thread->tid);
-            }
-        }
-        
-        // Block on semaphore
-        // Add this thread to the semaphore’s waiting list.
-        tcb->state = STATE_BLOCKED_SEM;
-        semaphores[sem_id].blocked_threads[semaphores[sem_id].blocked_count++] = tcb;
-        pthread_mutex_unlock(&semaphores[sem_id].mutex);
-        
-        // Wait to be woken up
-        while (tcb->state == STATE_BLOCKED_SEM) {
-            printf("%d is waiting in P\n",tcb->tid);
-            blocked_on_p_count++;
-            pthread_cond_signal(&timeCond);
-            pthread_cond_wait(&tcb->cond, &scheduler_mutex);
-            blocked_on_p_count--;
-            arrived_count++;
-        }
-        advance_time_to(int_time);
-    }
-    
-    // Blocked case: we were woken by V() at an integer time; return that tick
-    int ret = tcb->wake_time;
-    arrived_count--;
-    pthread_mutex_unlock(&scheduler_mutex);
-    return ret;
+    return sched_P(default_ctx, to_time(current_time), tid, sem_id) / SCH_TIME_FRAC;
 }
 
 int V(float current_time, int tid, int sem_id) {
-    pthread_mutex_lock(&scheduler_mutex);
-    printf("V called for tid:%d\n", tid);
+    return sched_V(default_ctx, to_time(current_time), tid, sem_id) / SCH_TIME_FRAC;
+}
 
-    barrier_wait();
-    printf("Barrier passed for %d in V\n",tid);
+void end_me(int tid) {
+    sched_end_me(default_ctx, tid);
+}
 
-    int int_time = ceil(current_time);
-    while (active_threads-blocked_on_p_count!=1 && global_time < int_time) {
-        pthread_cond_wait(&timeCond, &scheduler_mutex);
-    }
+void set_event_listener(sch_event_fn listener, void* arg) {
+    sched_set_event_listener(default_ctx, listener, arg);
+}
 
-    thread_control_block_t* tcb = &tcb_array[tid];
-    printf("V got a signal to run thread: %d\n", tid);
-
-    pthread_mutex_lock(&semaphores[sem_id].mutex);
-    
-    if (semaphores[sem_id].blocked_count > 0) {
-        // Find thread with lowest tid to wake up
-        int min_tid = INT_MAX;
-        int min_index = -1;
-        
-        for (int i = 0; i < semaphores[sem_id].blocked_count; i++) {
-            if (semaphores[sem_id].blocked_threads[i]->tid < min_tid) {
-                min_tid = semaphores[sem_id].blocked_threads[i]->tid;
-                min_index = i;
-            }
-        }
-        
-        if (min_index != -1) {
-            thread_control_block_t* tcb_to_wake = semaphores[sem_id].blocked_threads[min_index];
-            
-            // Remove from blocked list
-            for (int i = min_index; i < semaphores[sem_id].blocked_count - 1; i++) {
-                semaphores[sem_id].blocked_threads[i] = semaphores[sem_id].blocked_threads[i + 1];
-            }
-            semaphores[sem_id].blocked_count--;
-            
-            tcb_to_wake->wake_time = int_time;
-            tcb_to_wake->state = STATE_READY;
-            printf("%d signaled to be get unblocked after increasing semaphore in V\n", tcb_to_wake->tid);
-            pthread_cond_signal(&tcb_to_wake->cond);
-
-            // Reducing thread count so that main.c do not call any other function 
-            // and it shouldn't find arrived_count == active_threads.
-            // If it finds arrived_count == active_threads then the barrier might get crossed.
-            // We do not want that rather after V, P should get completed and then another function should get executed.
-            arrived_count--;
-        }
-    } else {
-        semaphores[sem_id].value++;
-    }
-    
-    arrived_count--;
-    pthread_mutex_unlock(&semaphores[sem_id].mutex);
-    pthread_mutex_unlock(&scheduler_mutex);
-    
-    return int_time;
+void configure_io_devices(int device_count, const enum io_discipline* disciplines) {
+    sched_configure_io_devices(default_ctx, device_count, disciplines);
 }
 
-void end_me(int tid) {
-    pthread_mutex_lock(&scheduler_mutex);
-
-    printf("end me called for tid:%d\n", tid);
-    
-    thread_control_block_t* tcb = &tcb_array[tid];
-    tcb->state = STATE_TERMINATED;
-    
-    // printf("In end me current thread: %d and tcb: %d", current_cpu_thread->tcb)
-    // If this was the current CPU thread, select a new one
-    if (current_cpu_thread == tcb) {
-        printf("Selecting next thread from here\n");
-        current_cpu_thread = select_next_thread();
-        if (current_cpu_thread != NULL) {
-            current_cpu_thread->state = STATE_RUNNING;
-            pthread_cond_signal(&current_cpu_thread->cond);
-            printf("%d signaled from endme\n",current_cpu_thread->tid);
-        }
-    }
+void configure_mlfq(const struct sch_mlfq_config* config) {
+    sched_configure_mlfq(default_ctx, config);
+}
 
-    active_threads--;
+void configure_cfs(const struct sch_cfs_config* config) {
+    sched_configure_cfs(default_ctx, config);
+}
 
-    // After active threads are reduced, need to wake up any thread which might be waiting for barrier cond.
-    pthread_cond_broadcast(&barrier_cond);
-    pthread_cond_broadcast(&timeCond);
-    pthread_mutex_unlock(&scheduler_mutex);
-}
\ No newline at end of file
+void set_nice(int tid, int nice) {
+    sched_set_nice(default_ctx, tid, nice);
+}
+
+void set_policy(const struct sch_policy* policy) {
+    sched_set_policy(default_ctx, policy);
+}
+
+void get_metrics(struct sch_metrics* metrics) {
+    sched_get_metrics(default_ctx, metrics);
+}
+
+void get_thread_metrics(int tid, struct sch_thread_metrics* metrics) {
+    sched_get_thread_metrics(default_ctx, tid, metrics);
+}
+
+void set_metrics_output(const char* path_prefix) {
+    sched_set_metrics_output(default_ctx, path_prefix);
+}
+
+void run_fibers(int worker_count, fiber_entry_fn entry, void* arg) {
+    sched_run_fibers(default_ctx, worker_count, entry, arg);
+}
+
+void run_stream(int worker_count, const struct sch_workload* workload) {
+    sched_run_stream(default_ctx, worker_count, workload);
+}
+
+void checkpoint_at(int64_t time, const char* path) {
+    sched_checkpoint_at(default_ctx, time, path);
+}
+
+int restore_checkpoint(const char* path, const struct sch_workload* workload) {
+    return sched_restore_checkpoint(default_ctx, path, workload);
+}
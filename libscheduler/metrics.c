@@ -0,0 +1,389 @@
+#include "scheduler.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct thread_metrics {
+    int tid;
+    int64_t arrival;    // call time, SCH_TIME_FRAC per tick
+    int64_t first_run;
+    int64_t completion;
+    int64_t ready_since;    // -1 while not ready
+    int64_t blocked_since;  // -1 while not blocked in P()
+    int64_t waiting;
+    int64_t cpu_time;
+    int64_t io_time;
+    int64_t sem_time;
+    int64_t level_time[MLFQ_MAX_LEVELS];
+};
+
+typedef struct thread_metrics thread_metrics_t;
+
+static int hist_bucket(int64_t value) {
+    if (value < HIST_LINEAR) return value < 0 ? 0 : value;
+    int exp = 63 - __builtin_clzll(value);
+    int sub = (value >> (exp - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return HIST_LINEAR + (exp - 6) * HIST_SUB_BUCKETS + sub;
+}
+
+// Largest value that falls in the bucket
+static int64_t hist_bucket_max(int bucket) {
+    if (bucket < HIST_LINEAR) return bucket;
+    int exp = (bucket - HIST_LINEAR) / HIST_SUB_BUCKETS + 6;
+    int sub = (bucket - HIST_LINEAR) % HIST_SUB_BUCKETS;
+    uint64_t low = ((uint64_t)(HIST_SUB_BUCKETS + sub)) << (exp - HIST_SUB_BITS);
+    uint64_t high = low + ((uint64_t)1 << (exp - HIST_SUB_BITS)) - 1;
+    return high > INT64_MAX ? INT64_MAX : (int64_t)high;
+}
+
+static void hist_add(histogram_t* h, double value) {
+    int64_t v = value + 0.5 < (double)INT64_MAX ? (int64_t)(value + 0.5) : INT64_MAX;
+    h->counts[hist_bucket(v)]++;
+    h->count++;
+    h->sum += value;
+    if (v > h->max) h->max = v;
+}
+
+static int64_t hist_percentile(const histogram_t* h, double p) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t)(p * h->count + 0.999999);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            int64_t v = hist_bucket_max(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+static void hist_latency(const histogram_t* h, struct sch_latency* out) {
+    out->mean = h->count > 0 ? h->sum / h->count : 0;
+    out->p50 = hist_percentile(h, 0.50);
+    out->p90 = hist_percentile(h, 0.90);
+    out->p99 = hist_percentile(h, 0.99);
+    out->max = h->max;
+}
+
+static void init_thread_metrics(thread_metrics_t* t, int tid) {
+    memset(t, 0, sizeof(*t));
+    t->tid = tid;
+    t->arrival = -1;
+    t->first_run = -1;
+    t->completion = -1;
+    t->ready_since = -1;
+    t->blocked_since = -1;
+}
+
+static void reserve_thread_metrics(metrics_t* m, int count) {
+    if (count <= m->capacity) return;
+    int capacity = m->capacity > 0 ? m->capacity : 16;
+    while (capacity < count) capacity *= 2;
+    m->threads = checked_realloc(m->threads, sizeof(thread_metrics_t) * capacity);
+    m->capacity = capacity;
+}
+
+// Start a run, the buffers of the last run are reused
+void metrics_init(sched_ctx_t* ctx, int thread_count) {
+    metrics_t* m = &ctx->metrics;
+    reserve_thread_metrics(m, thread_count);
+    m->count = thread_count;
+    for (int i = 0; i < thread_count; i++) init_thread_metrics(&m->threads[i], i);
+    m->threads_done = 0;
+    m->context_switches = 0;
+    m->busy_cpu_ticks = 0;
+    m->busy_io_ticks = 0;
+    for (int i = 0; i < m->core_last_count; i++) m->core_last_tid[i] = -1;
+    memset(&m->turnaround_hist, 0, sizeof(m->turnaround_hist));
+    memset(&m->waiting_hist, 0, sizeof(m->waiting_hist));
+    memset(&m->response_hist, 0, sizeof(m->response_hist));
+}
+
+// Thread tid takes over slot in a stream run
+void metrics_admit(sched_ctx_t* ctx, int slot, int tid) {
+    metrics_t* m = &ctx->metrics;
+    reserve_thread_metrics(m, slot + 1);
+    if (slot >= m->count) m->count = slot + 1;
+    init_thread_metrics(&m->threads[slot], tid);
+}
+
+void metrics_free(sched_ctx_t* ctx) {
+    metrics_t* m = &ctx->metrics;
+    free(m->threads);
+    m->threads = NULL;
+    m->count = 0;
+    m->capacity = 0;
+    free(m->core_last_tid);
+    m->core_last_tid = NULL;
+    m->core_last_count = 0;
+    free(m->output_prefix);
+    m->output_prefix = NULL;
+    if (m->stream_csv != NULL) fclose(m->stream_csv);
+    m->stream_csv = NULL;
+}
+
+void metrics_arrive(sched_ctx_t* ctx, int slot, int64_t time) {
+    thread_metrics_t* t = &ctx->metrics.threads[slot];
+    if (t->arrival < 0) t->arrival = time;
+}
+
+void metrics_ready(sched_ctx_t* ctx, int slot, int64_t time) {
+    ctx->metrics.threads[slot].ready_since = time;
+}
+
+void metrics_dispatch(sched_ctx_t* ctx, int core, int slot, int64_t time, int level, int ticks) {
+    metrics_t* m = &ctx->metrics;
+    thread_metrics_t* t = &m->threads[slot];
+    if (t->ready_since >= 0) {
+        t->waiting += time - t->ready_since;
+        t->ready_since = -1;
+    }
+    if (t->first_run < 0) {
+        t->first_run = time;
+        hist_add(&m->response_hist, time - (double)t->arrival / SCH_TIME_FRAC);
+    }
+    t->cpu_time++;
+    t->level_time[level]++;
+    m->busy_cpu_ticks += ticks;
+
+    if (core >= m->core_last_count) {
+        int count = core + 1;
+        m->core_last_tid = checked_realloc(m->core_last_tid, sizeof(int) * count);
+        for (int i = m->core_last_count; i < count; i++) m->core_last_tid[i] = -1;
+        m->core_last_count = count;
+    }
+    if (m->core_last_tid[core] != t->tid) m->context_switches++;
+    m->core_last_tid[core] = t->tid;
+}
+
+void metrics_io(sched_ctx_t* ctx, int slot, int64_t duration) {
+    ctx->metrics.threads[slot].io_time += duration;
+    ctx->metrics.busy_io_ticks += duration;
+}
+
+void metrics_block(sched_ctx_t* ctx, int slot, int64_t time) {
+    ctx->metrics.threads[slot].blocked_since = time;
+}
+
+void metrics_wake(sched_ctx_t* ctx, int slot, int64_t time) {
+    thread_metrics_t* t = &ctx->metrics.threads[slot];
+    if (t->blocked_since >= 0) {
+        t->sem_time += time - t->blocked_since;
+        t->blocked_since = -1;
+    }
+}
+
+static void fill_thread_metrics(sched_ctx_t* ctx, int slot, struct sch_thread_metrics* out) {
+    thread_metrics_t* m = &ctx->metrics.threads[slot];
+    out->tid = m->tid;
+    out->arrival = m->arrival >= 0 ? (double)m->arrival / SCH_TIME_FRAC : -1;
+    out->completion = m->completion;
+    out->turnaround = m->completion >= 0 ? m->completion - out->arrival : -1;
+    out->response = m->first_run >= 0 ? m->first_run - out->arrival : -1;
+    out->waiting = m->waiting;
+    out->cpu_time = m->cpu_time;
+    out->io_time = m->io_time;
+    out->sem_time = m->sem_time;
+    memcpy(out->level_time, m->level_time, sizeof(out->level_time));
+}
+
+// One column per MLFQ level
+static void write_csv_header(sched_ctx_t* ctx, FILE* fp) {
+    fprintf(fp, "tid,arrival,completion,turnaround,response,waiting,cpu_time,io_time,sem_time");
+    for (int lvl = 0; lvl < ctx->mlfq.levels; lvl++) fprintf(fp, ",level%d", lvl);
+    fprintf(fp, "\n");
+}
+
+static void write_csv_row(sched_ctx_t* ctx, FILE* fp, int slot) {
+    struct sch_thread_metrics m;
+    fill_thread_metrics(ctx, slot, &m);
+    fprintf(fp, "%d,%.1f,%" PRId64 ",%.1f,%.1f,%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64,
+            m.tid, m.arrival, m.completion, m.turnaround, m.response, m.waiting,
+            m.cpu_time, m.io_time, m.sem_time);
+    for (int lvl = 0; lvl < ctx->mlfq.levels; lvl++) fprintf(fp, ",%" PRId64, m.level_time[lvl]);
+    fprintf(fp, "\n");
+}
+
+void metrics_end(sched_ctx_t* ctx, int slot, int64_t time) {
+    metrics_t* m = &ctx->metrics;
+    thread_metrics_t* t = &m->threads[slot];
+    t->completion = time;
+    m->threads_done++;
+    hist_add(&m->turnaround_hist, t->arrival < 0 ? 0 : time - (double)t->arrival / SCH_TIME_FRAC);
+    hist_add(&m->waiting_hist, t->waiting);
+    if (m->stream_csv != NULL) write_csv_row(ctx, m->stream_csv, slot);
+}
+
+// A stream run reuses the slots of ended threads, so their rows are written
+// as they end, in completion order. Called with ctx->mutex held.
+void metrics_stream_begin(sched_ctx_t* ctx) {
+    metrics_t* m = &ctx->metrics;
+    if (m->output_prefix == NULL || m->stream_csv != NULL) return;
+    size_t len = strlen(m->output_prefix) + 6;
+    char* path = checked_realloc(NULL, len);
+    snprintf(path, len, "%s.csv", m->output_prefix);
+    m->stream_csv = fopen(path, "w");
+    if (m->stream_csv == NULL) {
+        TRACE_ERROR("metrics: cannot open %s\n", path);
+    } else {
+        write_csv_header(ctx, m->stream_csv);
+    }
+    free(path);
+}
+
+static void fill_metrics(sched_ctx_t* ctx, struct sch_metrics* out) {
+    metrics_t* m = &ctx->metrics;
+    int64_t time = ctx->global_time;
+    out->makespan = time;
+    out->threads_done = m->threads_done;
+    out->context_switches = m->context_switches;
+    out->cpu_utilization = time > 0 ? (double)m->busy_cpu_ticks / ((double)ctx->core_count * time) : 0;
+    out->io_utilization = time > 0 && ctx->io_device_count > 0 ? (double)m->busy_io_ticks / ((double)ctx->io_device_count * time) : 0;
+    out->throughput = time > 0 ? (double)m->threads_done / time : 0;
+    hist_latency(&m->turnaround_hist, &out->turnaround);
+    hist_latency(&m->waiting_hist, &out->waiting);
+    hist_latency(&m->response_hist, &out->response);
+}
+
+static void write_latency(FILE* fp, const char* name, const struct sch_latency* l, bool last) {
+    fprintf(fp, "  \"%s\": {\"mean\": %.3f, \"p50\": %" PRId64 ", \"p90\": %" PRId64 ", \"p99\": %" PRId64
+            ", \"max\": %" PRId64 "}%s\n",
+            name, l->mean, l->p50, l->p90, l->p99, l->max, last ? "" : ",");
+}
+
+// Called from sched_finish() with ctx->mutex held. The output is written
+// once, the next run needs sched_set_metrics_output() again.
+void metrics_write(sched_ctx_t* ctx) {
+    char* prefix = ctx->metrics.output_prefix;
+    if (prefix == NULL) return;
+    size_t len = strlen(prefix) + 6;
+    char* path = checked_realloc(NULL, len);
+
+    FILE* fp;
+    if (ctx->metrics.stream_csv != NULL) {
+        fclose(ctx->metrics.stream_csv);
+        ctx->metrics.stream_csv = NULL;
+    } else {
+        snprintf(path, len, "%s.csv", prefix);
+        fp = fopen(path, "w");
+        if (fp == NULL) {
+            TRACE_ERROR("metrics: cannot open %s\n", path);
+        } else {
+            write_csv_header(ctx, fp);
+            for (int slot = 0; slot < ctx->metrics.count; slot++) write_csv_row(ctx, fp, slot);
+            fclose(fp);
+        }
+    }
+
+    snprintf(path, len, "%s.json", prefix);
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        TRACE_ERROR("metrics: cannot open %s\n", path);
+    } else {
+        struct sch_metrics m;
+        fill_metrics(ctx, &m);
+        fprintf(fp, "{\n");
+        fprintf(fp, "  \"scheduler_type\": %d,\n", ctx->scheduler_type);
+        fprintf(fp, "  \"threads\": %d,\n", ctx->thread_count);
+        fprintf(fp, "  \"cpus\": %d,\n", ctx->core_count);
+        fprintf(fp, "  \"io_devices\": %d,\n", ctx->io_device_count);
+        fprintf(fp, "  \"makespan\": %" PRId64 ",\n", m.makespan);
+        fprintf(fp, "  \"threads_done\": %d,\n", m.threads_done);
+        fprintf(fp, "  \"context_switches\": %ld,\n", m.context_switches);
+        fprintf(fp, "  \"cpu_utilization\": %.4f,\n", m.cpu_utilization);
+        fprintf(fp, "  \"io_utilization\": %.4f,\n", m.io_utilization);
+        fprintf(fp, "  \"throughput\": %.6f,\n", m.throughput);
+        write_latency(fp, "turnaround", &m.turnaround, false);
+        write_latency(fp, "waiting", &m.waiting, false);
+        write_latency(fp, "response", &m.response, true);
+        fprintf(fp, "}\n");
+        fclose(fp);
+    }
+    free(path);
+    free(prefix);
+    ctx->metrics.output_prefix = NULL;
+}
+
+// Counters of a checkpoint, see checkpoint.c
+struct metrics_record {
+    int64_t count;
+    int64_t threads_done;
+    int64_t context_switches;
+    int64_t busy_cpu_ticks;
+    int64_t busy_io_ticks;
+    int64_t core_last_count;
+};
+
+// Called with ctx->mutex held
+bool metrics_save(sched_ctx_t* ctx, FILE* fp) {
+    metrics_t* m = &ctx->metrics;
+    struct metrics_record rec = {
+        .count = m->count,
+        .threads_done = m->threads_done,
+        .context_switches = m->context_switches,
+        .busy_cpu_ticks = m->busy_cpu_ticks,
+        .busy_io_ticks = m->busy_io_ticks,
+        .core_last_count = m->core_last_count,
+    };
+    return fwrite(&rec, sizeof(rec), 1, fp) == 1 &&
+           fwrite(m->core_last_tid, sizeof(int), m->core_last_count, fp) == (size_t)m->core_last_count &&
+           fwrite(&m->turnaround_hist, sizeof(histogram_t), 1, fp) == 1 &&
+           fwrite(&m->waiting_hist, sizeof(histogram_t), 1, fp) == 1 &&
+           fwrite(&m->response_hist, sizeof(histogram_t), 1, fp) == 1 &&
+           fwrite(m->threads, sizeof(thread_metrics_t), m->count, fp) == (size_t)m->count;
+}
+
+// Called with ctx->mutex held after metrics_init() for as many threads
+bool metrics_load(sched_ctx_t* ctx, FILE* fp) {
+    metrics_t* m = &ctx->metrics;
+    struct metrics_record rec;
+    if (fread(&rec, sizeof(rec), 1, fp) != 1 || rec.count != m->count ||
+        rec.core_last_count < 0 || rec.core_last_count > ctx->core_count) {
+        return false;
+    }
+    m->threads_done = rec.threads_done;
+    m->context_switches = rec.context_switches;
+    m->busy_cpu_ticks = rec.busy_cpu_ticks;
+    m->busy_io_ticks = rec.busy_io_ticks;
+    if (rec.core_last_count > m->core_last_count) {
+        m->core_last_tid = checked_realloc(m->core_last_tid, sizeof(int) * rec.core_last_count);
+    }
+    m->core_last_count = rec.core_last_count;
+    return fread(m->core_last_tid, sizeof(int), m->core_last_count, fp) == (size_t)m->core_last_count &&
+           fread(&m->turnaround_hist, sizeof(histogram_t), 1, fp) == 1 &&
+           fread(&m->waiting_hist, sizeof(histogram_t), 1, fp) == 1 &&
+           fread(&m->response_hist, sizeof(histogram_t), 1, fp) == 1 &&
+           fread(m->threads, sizeof(thread_metrics_t), m->count, fp) == (size_t)m->count;
+}
+
+void sched_get_metrics(sched_ctx_t* ctx, struct sch_metrics* metrics) {
+    pthread_mutex_lock(&ctx->mutex);
+    fill_metrics(ctx, metrics);
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+// In a stream run only live threads have metrics
+void sched_get_thread_metrics(sched_ctx_t* ctx, int tid, struct sch_thread_metrics* metrics) {
+    pthread_mutex_lock(&ctx->mutex);
+    thread_control_block_t* tcb = (tid >= 0 && tid < ctx->thread_count) ? find_thread(ctx, tid) : NULL;
+    if (tcb != NULL) {
+        fill_thread_metrics(ctx, tcb->slot, metrics);
+    } else {
+        memset(metrics, 0, sizeof(*metrics));
+        metrics->tid = -1;
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+void sched_set_metrics_output(sched_ctx_t* ctx, const char* path_prefix) {
+    pthread_mutex_lock(&ctx->mutex);
+    free(ctx->metrics.output_prefix);
+    ctx->metrics.output_prefix = NULL;
+    if (path_prefix != NULL) {
+        ctx->metrics.output_prefix = checked_realloc(NULL, strlen(path_prefix) + 1);
+        strcpy(ctx->metrics.output_prefix, path_prefix);
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+}
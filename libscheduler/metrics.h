@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Metrics
+// The scheduler reports what each thread does as it happens, so the metrics
+// are always up to date and cost O(1) per event. Latency percentiles come from
+// log-linear histograms: values below HIST_LINEAR are exact, larger ones fall
+// in one of HIST_SUB_BUCKETS buckets per power of two (about 3% error).
+
+#define HIST_LINEAR 64
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_LINEAR + (63 - 6) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    double sum;
+    int64_t max;
+} histogram_t;
+
+// Metrics of one scheduler instance, per-thread entries are by TCB slot
+typedef struct {
+    struct thread_metrics* threads;
+    int count;
+    int capacity;           // allocated entries of threads
+    FILE* stream_csv;       // stream run: rows are written as threads end
+    int threads_done;
+    long context_switches;
+    long busy_cpu_ticks;
+    long busy_io_ticks;
+    int* core_last_tid;     // thread each core ran last, -1 if none
+    int core_last_count;
+    histogram_t turnaround_hist;
+    histogram_t waiting_hist;
+    histogram_t response_hist;
+    char* output_prefix;
+} metrics_t;
+
+struct sched_ctx;
+
+void metrics_init(struct sched_ctx* ctx, int thread_count);
+void metrics_free(struct sched_ctx* ctx);
+void metrics_admit(struct sched_ctx* ctx, int slot, int tid);
+void metrics_stream_begin(struct sched_ctx* ctx);
+void metrics_arrive(struct sched_ctx* ctx, int slot, int64_t time);
+void metrics_ready(struct sched_ctx* ctx, int slot, int64_t time);
+void metrics_dispatch(struct sched_ctx* ctx, int core, int slot, int64_t time, int level, int ticks);
+void metrics_io(struct sched_ctx* ctx, int slot, int64_t duration);
+void metrics_block(struct sched_ctx* ctx, int slot, int64_t time);
+void metrics_wake(struct sched_ctx* ctx, int slot, int64_t time);
+void metrics_end(struct sched_ctx* ctx, int slot, int64_t time);
+void metrics_write(struct sched_ctx* ctx);
+bool metrics_save(struct sched_ctx* ctx, FILE* fp);
+bool metrics_load(struct sched_ctx* ctx, FILE* fp);
@@ -0,0 +1,460 @@
+#include "scheduler.h"
+#include "api.h"
+
+// Policies
+// A policy keeps the ready threads of every core and decides which one gets
+// the next tick. Each policy implements the same operations, see
+// scheduler.h; engine.h calls the built-in ones directly and a policy set
+// with set_policy() through its struct sch_policy.
+
+// FCFS
+// A thread waits in its core's ready_queue and is taken out when it gets a
+// tick, the earliest ready_time runs first.
+
+thread_control_block_t* select_next_thread_fcfs(queue_t* q) {
+    if (q->count == 0) return NULL;
+
+    int best_idx = -1;
+    sch_time_t best_time = INT64_MAX;
+    int best_tid  = INT_MAX;
+    for (int i = 0; i < q->count; i++) {
+        int idx = (q->front + i) % q->capacity;
+        thread_control_block_t* t = q->threads[idx];
+        TRACE_DEBUG("Thread %d ready time %" PRId64 "\n", t->tid, t->ready_time);
+        if (t->ready_time < best_time ||
+            (t->ready_time == best_time && t->tid < best_tid)) {
+            best_time = t->ready_time;
+            best_tid  = t->tid;
+            best_idx  = idx;
+        }
+    }
+    if (best_idx != -1) {
+        thread_control_block_t* res = q->threads[best_idx];
+        return res;
+    }
+    return NULL;
+}
+
+void fcfs_enqueue(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    enqueue(&core->ready_queue, tcb);
+}
+
+thread_control_block_t* fcfs_pick_next(sched_ctx_t* ctx, core_t* core) {
+    return select_next_thread_fcfs(&core->ready_queue);
+}
+
+// The running thread is never in the queue
+thread_control_block_t* fcfs_pick_except(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    return fcfs_pick_next(ctx, core);
+}
+
+void fcfs_on_tick(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    dequeue_tid_from_q(&core->ready_queue, tcb->tid);
+}
+
+void fcfs_on_block(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    dequeue_tid_from_q(&core->ready_queue, tcb->tid);
+}
+
+void fcfs_on_wake(sched_ctx_t* ctx, thread_control_block_t* tcb) {
+}
+
+int fcfs_count(sched_ctx_t* ctx, core_t* core) {
+    return core->ready_queue.count;
+}
+
+// The running thread is never in the queue
+bool fcfs_queued(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    return false;
+}
+
+void fcfs_on_time(sched_ctx_t* ctx) {
+}
+
+// SRTF
+// SRTF ready threads live in their core's srtf_heap ordered by (remaining_time, tid).
+// A thread stays in the heap while it runs so each tick only needs a
+// decrease-key; threads that have not arrived yet are still on the event
+// calendar and never reach the heap early.
+
+bool srtf_less(const thread_control_block_t* a, const thread_control_block_t* b) {
+    if (a->remaining_time != b->remaining_time) return a->remaining_time < b->remaining_time;
+    return a->tid < b->tid;
+}
+
+void srtf_enqueue(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    if (heap_contains(&core->srtf_heap, tcb)) {
+        heap_update(&core->srtf_heap, tcb);
+    } else {
+        heap_push(&core->srtf_heap, tcb);
+    }
+}
+
+thread_control_block_t* srtf_pick_next(sched_ctx_t* ctx, core_t* core) {
+    thread_control_block_t* res = heap_peek(&core->srtf_heap);
+    if (res != NULL) {
+        TRACE_DEBUG("Selected T%d by SRTF remaining=%d\n", res->tid, res->remaining_time);
+    }
+    return res;
+}
+
+thread_control_block_t* srtf_pick_except(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    return heap_peek_except(&core->srtf_heap, tcb);
+}
+
+void srtf_on_tick(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    heap_update(&core->srtf_heap, tcb);
+}
+
+void srtf_on_block(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    heap_remove(&core->srtf_heap, tcb);
+}
+
+void srtf_on_wake(sched_ctx_t* ctx, thread_control_block_t* tcb) {
+}
+
+int srtf_count(sched_ctx_t* ctx, core_t* core) {
+    return core->srtf_heap.count;
+}
+
+bool srtf_queued(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    return heap_contains(&core->srtf_heap, tcb);
+}
+
+void srtf_on_time(sched_ctx_t* ctx) {
+}
+
+// MLFQ
+// MLFQ levels are heaps ordered by (ready_time, tid); bit lvl of
+// mlfq_bitmap is set while level lvl holds a thread, so picking the highest
+// non-empty level is a single find-first-set. A thread stays in its level
+// while it runs and only moves on promotion or demotion.
+
+bool mlfq_less(const thread_control_block_t* a, const thread_control_block_t* b) {
+    if (a->ready_time != b->ready_time) return a->ready_time < b->ready_time;
+    return a->tid < b->tid;
+}
+
+static void update_mlfq_bitmap(core_t* core, int level) {
+    if (core->mlfq[level].count > 0) {
+        core->mlfq_bitmap |= 1u << level;
+    } else {
+        core->mlfq_bitmap &= ~(1u << level);
+    }
+}
+
+// The levels used are the ones of the thread's core
+void enqueue_mlfq(thread_control_block_t* tcb, int level) {
+    sched_ctx_t* ctx = tcb->ctx;
+    core_t* core = &ctx->cores[tcb->core];
+    if (level < 0) level = 0;
+    if (level >= ctx->mlfq.levels) level = ctx->mlfq.levels - 1;
+    heap_push(&core->mlfq[level], tcb);
+    update_mlfq_bitmap(core, level);
+    ctx->mlfq_data[tcb->slot].level = level;
+}
+
+void dequeue_mlfq(thread_control_block_t* tcb) {
+    sched_ctx_t* ctx = tcb->ctx;
+    core_t* core = &ctx->cores[tcb->core];
+    int level = ctx->mlfq_data[tcb->slot].level;
+    heap_remove(&core->mlfq[level], tcb);
+    update_mlfq_bitmap(core, level);
+}
+
+void demote_mlfq_thread(thread_control_block_t* tcb) {
+    sched_ctx_t* ctx = tcb->ctx;
+    int old = ctx->mlfq_data[tcb->slot].level;
+    int new_level = (old < ctx->mlfq.levels - 1) ? old + 1 : old;
+    dequeue_mlfq(tcb);
+    enqueue_mlfq(tcb, new_level);
+    ctx->mlfq_data[tcb->slot].quantum_used = 0;
+    TRACE_EVENT(TRACE_DEMOTE, tcb->tid, ctx->global_time, old, new_level);
+}
+
+// Move every queued thread back to level 0, keeping their arrival order
+static void boost_mlfq(sched_ctx_t* ctx) {
+    for (int c = 0; c < ctx->core_count; c++) {
+        core_t* core = &ctx->cores[c];
+        heap_t* top = &core->mlfq[0];
+        for (int i = 0; i < top->count; i++) {
+            ctx->mlfq_data[top->threads[i]->slot].quantum_used = 0;
+        }
+        for (int lvl = 1; lvl < ctx->mlfq.levels; lvl++) {
+            heap_t* level = &core->mlfq[lvl];
+            while (level->count > 0) {
+                thread_control_block_t* tcb = heap_pop(level);
+                ctx->mlfq_data[tcb->slot].quantum_used = 0;
+                enqueue_mlfq(tcb, 0);
+            }
+            update_mlfq_bitmap(core, lvl);
+        }
+    }
+    TRACE_EVENT(TRACE_BOOST, -1, ctx->global_time, 0, 0);
+}
+
+// Within a burst the thread is still queued at its level
+void mlfq_enqueue(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    if (mlfq_queued(ctx, core, tcb)) return;
+    enqueue_mlfq(tcb, ctx->mlfq_data[tcb->slot].level);
+}
+
+thread_control_block_t* mlfq_pick_next(sched_ctx_t* ctx, core_t* core) {
+    if (core->mlfq_bitmap == 0) return NULL;
+
+    int lvl = __builtin_ctz(core->mlfq_bitmap);
+    thread_control_block_t* next = heap_peek(&core->mlfq[lvl]);
+    TRACE_DEBUG("Picked T%d from level %d (quantum %d)\n",
+                next->tid, lvl, ctx->mlfq.quantum[lvl]);
+    return next;
+}
+
+thread_control_block_t* mlfq_pick_except(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    for (unsigned int bitmap = core->mlfq_bitmap; bitmap != 0; bitmap &= bitmap - 1) {
+        thread_control_block_t* next = heap_peek_except(&core->mlfq[__builtin_ctz(bitmap)], tcb);
+        if (next != NULL) return next;
+    }
+    return NULL;
+}
+
+// If the thread used its full quantum and is still not done, demote it.
+// FCFS levels have no quantum.
+void mlfq_on_tick(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    mlfq_info_t* info = &ctx->mlfq_data[tcb->slot];
+    int lvl = info->level;
+    info->quantum_used++;
+    if (ctx->mlfq.discipline[lvl] == MLFQ_RR && info->quantum_used >= ctx->mlfq.quantum[lvl] &&
+        tcb->remaining_time > 0) {
+        tcb->ready_time = tcb->op_time;
+        demote_mlfq_thread(tcb);
+    }
+}
+
+void mlfq_on_block(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    dequeue_mlfq(tcb);
+}
+
+// A new burst starts over at level 0
+void mlfq_on_wake(sched_ctx_t* ctx, thread_control_block_t* tcb) {
+    dequeue_mlfq(tcb);
+    ctx->mlfq_data[tcb->slot].quantum_used = 0;
+    ctx->mlfq_data[tcb->slot].level = 0;
+}
+
+int mlfq_count(sched_ctx_t* ctx, core_t* core) {
+    int count = 0;
+    for (int i = 0; i < ctx->mlfq.levels; i++) count += core->mlfq[i].count;
+    return count;
+}
+
+bool mlfq_queued(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    return heap_contains(&core->mlfq[ctx->mlfq_data[tcb->slot].level], tcb);
+}
+
+// A due boost applies to this tick's decisions
+void mlfq_on_time(sched_ctx_t* ctx) {
+    int interval = ctx->mlfq.boost_interval;
+    if (interval > 0 && ctx->global_time >= ctx->next_boost) {
+        boost_mlfq(ctx);
+        ctx->next_boost = (ctx->global_time / interval + 1) * interval;
+    }
+}
+
+// CFS
+// CFS ready threads live in their core's cfs_heap ordered by (vruntime, tid)
+// and stay there while they run, like SRTF. A tick adds more vruntime the
+// lower the thread's weight. The thread holding the core's slice keeps
+// being picked until the slice is used up, then the leftmost thread runs.
+// vruntime is only compared within a core, a thread moving to another core
+// keeps its distance to min_vruntime.
+
+// Weight of nice -20 to 19, as in Linux
+static const int nice_weights[40] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,
+    3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,
+    335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,
+    36,    29,    23,    18,    15,
+};
+
+int cfs_nice_weight(int nice) {
+    if (nice < -20) nice = -20;
+    if (nice > 19) nice = 19;
+    return nice_weights[nice + 20];
+}
+
+bool cfs_less(const thread_control_block_t* a, const thread_control_block_t* b) {
+    int64_t va = a->ctx->cfs_data[a->slot].vruntime;
+    int64_t vb = b->ctx->cfs_data[b->slot].vruntime;
+    if (va != vb) return va < vb;
+    return a->tid < b->tid;
+}
+
+// Ticks tcb may run once picked: its weighted share of the period
+static int cfs_slice(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    int64_t period = ctx->cfs.target_latency;
+    int64_t min_period = (int64_t)core->cfs_heap.count * ctx->cfs.min_granularity;
+    if (min_period > period) period = min_period;
+    int64_t slice = core->cfs_load > 0 ? period * ctx->cfs_data[tcb->slot].weight / core->cfs_load : period;
+    return slice < ctx->cfs.min_granularity ? ctx->cfs.min_granularity : (int)slice;
+}
+
+void cfs_enqueue(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    if (heap_contains(&core->cfs_heap, tcb)) return;
+
+    cfs_info_t* info = &ctx->cfs_data[tcb->slot];
+    if (info->core == -1) {
+        info->vruntime = core->min_vruntime;
+    } else {
+        if (info->core != core->id) {
+            info->vruntime += core->min_vruntime - ctx->cores[info->core].min_vruntime;
+        }
+        // A thread back from I/O or a semaphore may be at most half a
+        // period behind, so sleeping does not bank CPU time
+        int64_t floor = core->min_vruntime - (int64_t)ctx->cfs.target_latency * CFS_TICK_VRUNTIME / 2;
+        if (info->waking && info->vruntime < floor) info->vruntime = floor;
+    }
+    info->waking = false;
+    info->core = core->id;
+    heap_push(&core->cfs_heap, tcb);
+    core->cfs_load += info->weight;
+}
+
+thread_control_block_t* cfs_pick_next(sched_ctx_t* ctx, core_t* core) {
+    thread_control_block_t* curr = core->cfs_curr;
+    if (curr != NULL && heap_contains(&core->cfs_heap, curr) &&
+        core->slice_used < cfs_slice(ctx, core, curr)) {
+        return curr;
+    }
+    return heap_peek(&core->cfs_heap);
+}
+
+thread_control_block_t* cfs_pick_except(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    thread_control_block_t* curr = core->cfs_curr;
+    if (curr != NULL && curr != tcb && heap_contains(&core->cfs_heap, curr) &&
+        core->slice_used < cfs_slice(ctx, core, curr)) {
+        return curr;
+    }
+    return heap_peek_except(&core->cfs_heap, tcb);
+}
+
+void cfs_on_tick(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    cfs_info_t* info = &ctx->cfs_data[tcb->slot];
+    if (tcb != core->cfs_curr || core->slice_used >= cfs_slice(ctx, core, tcb)) {
+        core->cfs_curr = tcb;
+        core->slice_used = 0;
+    }
+    core->slice_used++;
+    info->vruntime += (int64_t)CFS_TICK_VRUNTIME * CFS_NICE_0_WEIGHT / info->weight;
+    heap_update(&core->cfs_heap, tcb);
+
+    int64_t leftmost = ctx->cfs_data[heap_peek(&core->cfs_heap)->slot].vruntime;
+    if (leftmost > core->min_vruntime) core->min_vruntime = leftmost;
+}
+
+void cfs_on_block(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    if (!heap_contains(&core->cfs_heap, tcb)) return;
+    heap_remove(&core->cfs_heap, tcb);
+    core->cfs_load -= ctx->cfs_data[tcb->slot].weight;
+}
+
+void cfs_on_wake(sched_ctx_t* ctx, thread_control_block_t* tcb) {
+    ctx->cfs_data[tcb->slot].waking = true;
+}
+
+int cfs_count(sched_ctx_t* ctx, core_t* core) {
+    return core->cfs_heap.count;
+}
+
+bool cfs_queued(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    return heap_contains(&core->cfs_heap, tcb);
+}
+
+void cfs_on_time(sched_ctx_t* ctx) {
+}
+
+// Policies set with set_policy()
+// The policy sees threads and cores by number, a thread it returns from
+// pick_next() must be queued on that core.
+
+static void thread_info(thread_control_block_t* tcb, struct sch_thread_info* info) {
+    info->tid = tcb->tid;
+    info->remaining_time = tcb->remaining_time;
+    info->ready_time = tcb->ready_time;
+    info->last_cpu = tcb->last_core;
+}
+
+void ext_enqueue(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    struct sch_thread_info info;
+    thread_info(tcb, &info);
+    ctx->policy->enqueue(ctx->policy_state, core->id, &info);
+}
+
+thread_control_block_t* ext_pick_next(sched_ctx_t* ctx, core_t* core) {
+    int tid = ctx->policy->pick_next(ctx->policy_state, core->id);
+    if (tid < 0) return NULL;
+    thread_control_block_t* tcb = tid < ctx->thread_count ? find_thread(ctx, tid) : NULL;
+    if (tcb == NULL) {
+        TRACE_ERROR("Error: policy %s picked unknown thread %d\n", ctx->policy->name, tid);
+    }
+    return tcb;
+}
+
+// Without a pick_except callback there is nothing to take if the policy
+// would run tcb next
+thread_control_block_t* ext_pick_except(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    if (tcb == NULL || ctx->policy->pick_except == NULL) {
+        thread_control_block_t* next = ext_pick_next(ctx, core);
+        return next != tcb ? next : NULL;
+    }
+    int tid = ctx->policy->pick_except(ctx->policy_state, core->id, tcb->tid);
+    if (tid < 0) return NULL;
+    thread_control_block_t* next = tid < ctx->thread_count ? find_thread(ctx, tid) : NULL;
+    if (next == NULL) {
+        TRACE_ERROR("Error: policy %s picked unknown thread %d\n", ctx->policy->name, tid);
+    }
+    return next != tcb ? next : NULL;
+}
+
+void ext_on_tick(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    if (ctx->policy->on_tick == NULL) return;
+    struct sch_thread_info info;
+    thread_info(tcb, &info);
+    ctx->policy->on_tick(ctx->policy_state, core->id, &info);
+}
+
+void ext_on_block(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    ctx->policy->on_block(ctx->policy_state, core->id, tcb->tid);
+}
+
+void ext_on_wake(sched_ctx_t* ctx, thread_control_block_t* tcb) {
+    if (ctx->policy->on_wake == NULL) return;
+    struct sch_thread_info info;
+    thread_info(tcb, &info);
+    ctx->policy->on_wake(ctx->policy_state, &info);
+}
+
+int ext_count(sched_ctx_t* ctx, core_t* core) {
+    return ctx->policy->count(ctx->policy_state, core->id);
+}
+
+bool ext_queued(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb) {
+    return ctx->policy->queued(ctx->policy_state, core->id, tcb->tid);
+}
+
+void ext_on_time(sched_ctx_t* ctx) {
+    if (ctx->policy->on_time == NULL) return;
+    ctx->policy->on_time(ctx->policy_state, ctx->global_time);
+}
+
+// Drop the policy set for the run, the built-in one is used again
+void drop_policy(sched_ctx_t* ctx) {
+    if (ctx->policy != NULL && ctx->policy->destroy != NULL) {
+        ctx->policy->destroy(ctx->policy_state);
+    }
+    ctx->policy = NULL;
+    ctx->policy_state = NULL;
+}
@@ -2,49 +2,64 @@
 #include "api.h"
 #include <stdio.h>
 
-// Global variables definition
-int global_time = 0;
-int global_IO_time = 0;
-enum sch_type scheduler_type;
-int thread_count;
-int active_threads;
-int arrived_count = 0;
-int blocked_on_p_count = 0;
-queue_t mlfq[5];
-mlfq_info_t mlfq_data[MAX_THREADS];
-
-pthread_cond_t barrier_cond = PTHREAD_COND_INITIALIZER;
-pthread_cond_t timeCond = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t scheduler_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-thread_control_block_t* tcb_array = NULL;
-queue_t ready_queue;
-queue_t io_queue;
-semaphore_t semaphores[MAX_NUM_SEM];
-
-thread_control_block_t* current_cpu_thread = NULL;
-thread_control_block_t* current_io_thread = NULL;
+void* checked_realloc(void* ptr, size_t size) {
+    void* res = realloc(ptr, size);
+    if (res == NULL && size > 0) {
+        perror("realloc() error");
+        exit(EXIT_FAILURE);
+    }
+    return res;
+}
 
 // Queue operations
 void init_queue(queue_t* q) {
+    q->threads = NULL;
+    q->capacity = 0;
     q->front = 0;
     q->rear = -1;
     q->count = 0;
 }
 
+void free_queue(queue_t* q) {
+    free(q->threads);
+    init_queue(q);
+}
+
+// Empty the queue, keeping its buffer
+void clear_queue(queue_t* q) {
+    q->front = 0;
+    q->rear = -1;
+    q->count = 0;
+}
+
+// Double the ring buffer and unwrap it so front is at index 0
+static void grow_queue(queue_t* q) {
+    int new_capacity = q->capacity > 0 ? q->capacity * 2 : 16;
+    thread_control_block_t** threads = checked_realloc(NULL, sizeof(*threads) * new_capacity);
+    for (int i = 0; i < q->count; i++) {
+        threads[i] = q->threads[(q->front + i) % q->capacity];
+    }
+    free(q->threads);
+    q->threads = threads;
+    q->capacity = new_capacity;
+    q->front = 0;
+    q->rear = q->count - 1;
+}
+
 void enqueue(queue_t* q, thread_control_block_t* tcb) {
-    if (q->count < MAX_THREADS) {
-        q->rear = (q->rear + 1) % MAX_THREADS;
-        q->threads[q->rear] = tcb;
-        q->count++;
+    if (q->count == q->capacity) {
+        grow_queue(q);
     }
+    q->rear = (q->rear + 1) % q->capacity;
+    q->threads[q->rear] = tcb;
+    q->count++;
 }
 
 thread_control_block_t* dequeue(queue_t* q) {
     if (q->count == 0) return NULL;
     
     thread_control_block_t* tcb = q->threads[q->front];
-    q->front = (q->front + 1) % MAX_THREADS;
+    q->front = (q->front + 1) % q->capacity;
     q->count--;
     return tcb;
 }
@@ -56,15 +71,15 @@ thread_control_block_t* peek(queue_t* q) {
 
 thread_control_block_t* dequeue_at_index(queue_t* q, int absolute_index) {
     if (q->count == 0) return NULL;
-    int idx = absolute_index % MAX_THREADS;
+    int idx = absolute_index % q->capacity;
     thread_control_block_t* res = q->threads[idx];
-    int last = (q->front + q->count - 1) % MAX_THREADS;
+    int last = (q->front + q->count - 1) % q->capacity;
     while (idx != last) {
-        int next = (idx + 1) % MAX_THREADS;
+        int next = (idx + 1) % q->capacity;
         q->threads[idx] = q->threads[next];
         idx = next;
     }
-    q->rear = (q->rear - 1 + MAX_THREADS) % MAX_THREADS;
+    q->rear = (q->rear - 1 + q->capacity) % q->capacity;
     q->count--;
     return res;
 }
@@ -72,7 +87,7 @@ thread_control_block_t* dequeue_at_index(queue_t* q, int absolute_index) {
 void dequeue_tid_from_q(queue_t* q, int tid) {
     int idx = -1;
     for (int i = 0; i < q->count; i++) {
-        int pos = (q->front + i) % MAX_THREADS;
+        int pos = (q->front + i) % q->capacity;
         if (q->threads[pos]->tid == tid) {
             idx = pos;
             break;
@@ -84,214 +99,560 @@ void dequeue_tid_from_q(queue_t* q, int tid) {
     }
 }
 
-void advance_time_to(int target_time) {
-    while (global_time < target_time) {
-        global_time++;
-        printf("Global time : %d\n", global_time);
-        pthread_cond_broadcast(&timeCond);
+// Heap operations
+static void heap_swap(heap_t* h, int i, int j) {
+    thread_control_block_t* tmp = h->threads[i];
+    h->threads[i] = h->threads[j];
+    h->threads[j] = tmp;
+    h->threads[i]->heap_pos[h->slot] = i;
+    h->threads[j]->heap_pos[h->slot] = j;
+}
+
+static void heap_sift_up(heap_t* h, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!h->less(h->threads[i], h->threads[parent])) break;
+        heap_swap(h, i, parent);
+        i = parent;
     }
 }
 
-void advance_IO_time_to(int target_time) {
-    while (global_IO_time < target_time) {
-        global_IO_time++;
+static void heap_sift_down(heap_t* h, int i) {
+    while (true) {
+        int left = 2 * i + 1;
+        int right = left + 1;
+        int best = i;
+        if (left < h->count && h->less(h->threads[left], h->threads[best])) best = left;
+        if (right < h->count && h->less(h->threads[right], h->threads[best])) best = right;
+        if (best == i) break;
+        heap_swap(h, i, best);
+        i = best;
     }
 }
 
-thread_control_block_t* select_next_thread() {
-    if (scheduler_type == SCH_FCFS) {
-        return select_next_thread_fcfs(&ready_queue);
-    } 
-    else if (scheduler_type == SCH_SRTF) {
-        return select_next_thread_srtf();
-    } else if (scheduler_type == SCH_MLFQ)
-        return select_next_thread_mlfq();
-    else {
-        printf("Error: Unknown scheduler type!\n");
-        return NULL;
+void init_heap(heap_t* h, heap_slot_t slot, heap_less_fn less) {
+    h->threads = NULL;
+    h->capacity = 0;
+    h->count = 0;
+    h->slot = slot;
+    h->less = less;
+}
+
+void free_heap(heap_t* h) {
+    free(h->threads);
+    h->threads = NULL;
+    h->capacity = 0;
+    h->count = 0;
+}
+
+// Empty the heap, keeping its buffer
+void clear_heap(heap_t* h) {
+    h->count = 0;
+}
+
+bool heap_contains(heap_t* h, thread_control_block_t* tcb) {
+    int i = tcb->heap_pos[h->slot];
+    return i != -1 && i < h->count && h->threads[i] == tcb;
+}
+
+void heap_push(heap_t* h, thread_control_block_t* tcb) {
+    if (heap_contains(h, tcb)) return;
+    if (h->count == h->capacity) {
+        h->capacity = h->capacity > 0 ? h->capacity * 2 : 16;
+        h->threads = checked_realloc(h->threads, sizeof(*h->threads) * h->capacity);
     }
+    h->threads[h->count] = tcb;
+    tcb->heap_pos[h->slot] = h->count;
+    h->count++;
+    heap_sift_up(h, h->count - 1);
 }
 
-thread_control_block_t* select_next_thread_fcfs(queue_t* q) {
-    if (q->count == 0) return NULL;
+thread_control_block_t* heap_peek(heap_t* h) {
+    if (h->count == 0) return NULL;
+    return h->threads[0];
+}
 
-    int best_idx = -1;
-    float best_tick = FLT_MAX;
-    int best_tid  = INT_MAX;
-    for (int i = 0; i < q->count; i++) {
-        int idx = (q->front + i) % MAX_THREADS;
-        thread_control_block_t* t = q->threads[idx];
-        printf("Thread %d ready arrival tick %f\n", t->tid, t->ready_arrival_tick);
-        if (t->ready_arrival_tick < best_tick ||
-            (t->ready_arrival_tick == best_tick && t->tid < best_tid)) {
-            best_tick = t->ready_arrival_tick;
-            best_tid  = t->tid;
-            best_idx  = idx;
-        }
+// Top thread other than skip: if skip is the top, the next one is a child
+thread_control_block_t* heap_peek_except(heap_t* h, thread_control_block_t* skip) {
+    if (h->count == 0) return NULL;
+    if (h->threads[0] != skip) return h->threads[0];
+    if (h->count == 1) return NULL;
+    if (h->count == 2 || h->less(h->threads[1], h->threads[2])) return h->threads[1];
+    return h->threads[2];
+}
+
+thread_control_block_t* heap_pop(heap_t* h) {
+    if (h->count == 0) return NULL;
+    thread_control_block_t* res = h->threads[0];
+    heap_remove(h, res);
+    return res;
+}
+
+void heap_remove(heap_t* h, thread_control_block_t* tcb) {
+    if (!heap_contains(h, tcb)) return;
+    int i = tcb->heap_pos[h->slot];
+    int last = h->count - 1;
+    if (i != last) heap_swap(h, i, last);
+    tcb->heap_pos[h->slot] = -1;
+    h->count--;
+    if (i < h->count) {
+        thread_control_block_t* moved = h->threads[i];
+        heap_sift_up(h, i);
+        heap_sift_down(h, moved->heap_pos[h->slot]);
     }
-    if (best_idx != -1) {
-        thread_control_block_t* res = q->threads[best_idx];
-        return res;
+}
+
+// Restore heap order after the key of tcb changed
+void heap_update(heap_t* h, thread_control_block_t* tcb) {
+    if (!heap_contains(h, tcb)) return;
+    heap_sift_up(h, tcb->heap_pos[h->slot]);
+    heap_sift_down(h, tcb->heap_pos[h->slot]);
+}
+
+// First whole tick at or after a call time
+int64_t time_tick(sch_time_t time) {
+    int64_t tick = time / SCH_TIME_FRAC;
+    return tick * SCH_TIME_FRAC < time ? tick + 1 : tick;
+}
+
+// Nothing happens at the ticks in between, so the clock jumps to target_time
+// however far away it is
+void advance_time_to(sched_ctx_t* ctx, int64_t target_time) {
+    if (target_time <= ctx->global_time) return;
+    int64_t skipped = target_time - ctx->global_time;
+    ctx->global_time = target_time;
+    TRACE_EVENT(TRACE_TIME, -1, ctx->global_time, skipped > INT32_MAX ? INT32_MAX : (int)skipped, 0);
+}
+
+// Event calendar
+// Threads publish the operation they want next together with its simulated time.
+// The simulation only moves forward once every live thread has published
+// (unpublished_count == 0), so each decision sees every event that could affect
+// it. Threads waiting for CPU, I/O or a semaphore do not take part in this and
+// are only woken when their own call returns.
+
+// Calls returning at the same tick go back in this order, so the callers see
+// a CPU tick end before an I/O completion and a V before the P it woke up.
+static const int release_order[] = {
+    [OP_NONE] = 0, [OP_CPU] = 0, [OP_IO] = 1, [OP_V] = 2, [OP_P] = 3, [OP_END] = 0
+};
+
+bool event_less(const thread_control_block_t* a, const thread_control_block_t* b) {
+    if (a->event_time != b->event_time) return a->event_time < b->event_time;
+    if (a->event_type != b->event_type) return a->event_type < b->event_type;
+    if (a->event_type == EVENT_RELEASE && a->op != b->op) {
+        return release_order[a->op] < release_order[b->op];
     }
-    return NULL;
+    return a->tid < b->tid;
 }
 
-thread_control_block_t* select_next_thread_srtf() {
-    if (ready_queue.count == 0) return NULL;
+static void schedule_event(thread_control_block_t* tcb, event_type_t type, int64_t time) {
+    sched_ctx_t* ctx = tcb->ctx;
+    tcb->event_type = type;
+    tcb->event_time = time;
+    heap_push(&ctx->event_queue, tcb);
+}
 
-    // Temporary candidate array
-    thread_control_block_t* candidates[MAX_THREADS];
-    int candidate_count = 0;
+void emit_event(enum sch_event_type type, thread_control_block_t* tcb, int64_t start, int64_t end, int sem_id) {
+    sched_ctx_t* ctx = tcb->ctx;
+    if (ctx->event_listener == NULL) return;
+    struct sch_event event = {
+        .seq = ctx->event_seq++,
+        .type = type,
+        .tid = tcb->tid,
+        .core = tcb->last_core,
+        .time = ctx->global_time,
+        .start = start,
+        .end = end,
+        .sem_id = sem_id,
+    };
+    ctx->event_listener(&event, ctx->event_listener_arg);
+}
 
-    // Step 1 & 2: filter threads that are ready to run now
-    for (int i = 0; i < ready_queue.count; i++) {
-        int idx = (ready_queue.front + i) % MAX_THREADS;
-        thread_control_block_t* t = ready_queue.threads[idx];
+int format_gantt_line(char* buf, size_t size, const struct sch_event* event, int cpu_count) {
+    switch (event->type) {
+        case SCH_EVENT_CPU:
+            if (cpu_count > 1) {
+                return snprintf(buf, size, "%3" PRId64 "~%3" PRId64 ": T%d, CPU%d\n",
+                                event->start, event->end, event->tid, event->core);
+            }
+            return snprintf(buf, size, "%3" PRId64 "~%3" PRId64 ": T%d, CPU\n", event->start, event->end, event->tid);
+        case SCH_EVENT_IO_DONE:
+            return snprintf(buf, size, "   ~%3" PRId64 ": T%d, Return from IO\n", event->end, event->tid);
+        case SCH_EVENT_P:
+            return snprintf(buf, size, "   ~%3" PRId64 ": T%d, Return from P%d\n", event->end, event->tid, event->sem_id);
+        case SCH_EVENT_V:
+            return snprintf(buf, size, "   ~%3" PRId64 ": T%d, Return from V%d\n", event->end, event->tid, event->sem_id);
+        default:
+            return 0;
+    }
+}
 
-        if (t->ready_arrival_tick <= global_time) {
-            candidates[candidate_count++] = t;
-            printf("Candidate T%d: ready_arrival_tick=%f, remaining=%d\n",
-                   t->tid, t->ready_arrival_tick, t->remaining_time);
-        }
-        else {
-            printf("Lagging Candidate T%d: ready_arrival_tick=%f, remaining=%d\n",
-                t->tid, t->ready_arrival_tick, t->remaining_time);
-        }
+// The call returns time to the thread once the simulation reaches it.
+static void release_thread(thread_control_block_t* tcb, int64_t time) {
+    schedule_event(tcb, EVENT_RELEASE, time);
+}
+
+// I/O devices
+// Every device serves one request at a time without preemption and keeps
+// its own clock. Outside FIFO a request waits in the device's heap until the
+// device is free; like the CPUs, the device picks its next request only once
+// every request for the current tick is known.
+
+bool io_fifo_less(const thread_control_block_t* a, const thread_control_block_t* b) {
+    return a->io_seq < b->io_seq;
+}
+
+bool io_shortest_less(const thread_control_block_t* a, const thread_control_block_t* b) {
+    if (a->op_arg != b->op_arg) return a->op_arg < b->op_arg;
+    return a->io_seq < b->io_seq;
+}
+
+// Level 0 is the highest priority, every thread is at level 0 outside MLFQ
+bool io_priority_less(const thread_control_block_t* a, const thread_control_block_t* b) {
+    int level_a = a->ctx->mlfq_data[a->slot].level;
+    int level_b = b->ctx->mlfq_data[b->slot].level;
+    if (level_a != level_b) return level_a < level_b;
+    return a->io_seq < b->io_seq;
+}
+
+// dev->requests must have been set up with init_heap(), its buffer is kept
+void init_io_device(io_device_t* dev, int id, enum io_discipline discipline) {
+    static const heap_less_fn io_less[] = {
+        [IO_FIFO] = io_fifo_less,
+        [IO_SHORTEST] = io_shortest_less,
+        [IO_PRIORITY] = io_priority_less,
+    };
+    if (discipline < IO_FIFO || discipline > IO_PRIORITY) {
+        TRACE_ERROR("Error: Unknown I/O discipline %d, using FIFO\n", discipline);
+        discipline = IO_FIFO;
     }
+    dev->id = id;
+    dev->discipline = discipline;
+    dev->current = NULL;
+    dev->time = 0;
+    dev->requests.less = io_less[discipline];
+    clear_heap(&dev->requests);
+}
 
-    // Step 3: pick best among candidates
-    if (candidate_count == 0) {
-        // No thread is ready yet → return NULL
-        // If all threads are lagging behind the global time then we should signal thread which arrived first.
-        // Also increase global time to that point.
-        thread_control_block_t* earliest_thread = select_next_thread_fcfs(&ready_queue);
-        if (earliest_thread != NULL) {
-            advance_time_to(earliest_thread->ready_arrival_tick);
-            return earliest_thread;
-        }
-        return NULL;
+// Start the next request on every free device, returns false if none started
+static bool dispatch_idle_devices(sched_ctx_t* ctx) {
+    bool dispatched = false;
+    for (int i = 0; i < ctx->io_device_count; i++) {
+        io_device_t* dev = &ctx->io_devices[i];
+        if (dev->current != NULL || dev->requests.count == 0) continue;
+        thread_control_block_t* tcb = heap_pop(&dev->requests);
+        dev->current = tcb;
+        dev->time = ctx->global_time + tcb->op_arg;
+        metrics_io(ctx, tcb->slot, tcb->op_arg);
+        emit_event(SCH_EVENT_IO_START, tcb, ctx->global_time, dev->time, -1);
+        release_thread(tcb, dev->time);
+        dispatched = true;
+    }
+    return dispatched;
+}
+
+static void process_io(thread_control_block_t* tcb) {
+    sched_ctx_t* ctx = tcb->ctx;
+    io_device_t* dev = &ctx->io_devices[tcb->io_device];
+    tcb->state = STATE_BLOCKED_IO;
+    tcb->io_seq = ctx->io_request_seq++;
+
+    // A FIFO device serves requests in arrival order, so the slot of the
+    // request is known right away
+    if (dev->discipline == IO_FIFO) {
+        int64_t start_time = dev->time > ctx->global_time ? dev->time : ctx->global_time;
+        dev->time = start_time + tcb->op_arg;
+        metrics_io(ctx, tcb->slot, tcb->op_arg);
+        emit_event(SCH_EVENT_IO_START, tcb, start_time, dev->time, -1);
+        release_thread(tcb, dev->time);
+        return;
     }
+    heap_push(&dev->requests, tcb);
+}
 
-    int best_idx = -1;
-    int best_remaining = INT_MAX;
-    int best_tid = INT_MAX;
-
-    for (int i = 0; i < candidate_count; i++) {
-        thread_control_block_t* t = candidates[i];
-        if (t->remaining_time < best_remaining ||
-            (t->remaining_time == best_remaining && t->tid < best_tid)) {
-            best_remaining = t->remaining_time;
-            best_tid = t->tid;
-            best_idx = i;
+// Semaphores
+// A semaphore is created with value 0 the first time its id is used. V()
+// wakes the blocked thread with the lowest tid, the top of the blocked heap.
+
+bool sem_waiter_less(const thread_control_block_t* a, const thread_control_block_t* b) {
+    return a->tid < b->tid;
+}
+
+static unsigned int sem_slot(int sem_id, int capacity) {
+    return ((unsigned int)sem_id * 2654435761u) & (capacity - 1);
+}
+
+static void grow_sem_table(sem_table_t* table) {
+    int old_capacity = table->capacity;
+    semaphore_t** old_slots = table->slots;
+    table->capacity = old_capacity > 0 ? old_capacity * 2 : 16;
+    table->slots = checked_realloc(NULL, sizeof(*table->slots) * table->capacity);
+    memset(table->slots, 0, sizeof(*table->slots) * table->capacity);
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_slots[i] == NULL) continue;
+        unsigned int slot = sem_slot(old_slots[i]->id, table->capacity);
+        while (table->slots[slot] != NULL) {
+            slot = (slot + 1) & (table->capacity - 1);
         }
+        table->slots[slot] = old_slots[i];
     }
+    free(old_slots);
+}
 
-    thread_control_block_t* res = candidates[best_idx];
-    printf("Selected T%d by SRTF remaining=%d\n", res->tid, res->remaining_time);
+semaphore_t* find_semaphore(sem_table_t* table, int sem_id) {
+    // Keep the load factor at most 1/2
+    if (2 * (table->count + 1) > table->capacity) {
+        grow_sem_table(table);
+    }
+    unsigned int slot = sem_slot(sem_id, table->capacity);
+    while (table->slots[slot] != NULL) {
+        if (table->slots[slot]->id == sem_id) return table->slots[slot];
+        slot = (slot + 1) & (table->capacity - 1);
+    }
 
-    return res;
+    semaphore_t* sem = checked_realloc(NULL, sizeof(semaphore_t));
+    sem->id = sem_id;
+    sem->value = 0;
+    init_heap(&sem->blocked, HEAP_SLOT_WAIT, sem_waiter_less);
+    table->slots[slot] = sem;
+    table->count++;
+    return sem;
 }
 
-void enqueue_mlfq(thread_control_block_t* tcb, int level) {
-    if (level < 0) level = 0;
-    if (level >= 5) level = 4;
-    enqueue(&mlfq[level], tcb);
-    mlfq_data[tcb->tid].level = level;
-    tcb->state = STATE_READY;
-}
-
-void demote_mlfq_thread(thread_control_block_t* tcb) {
-    int old = mlfq_data[tcb->tid].level;
-    int new_level = (old < 4) ? old + 1 : old;
-    enqueue_mlfq(tcb, new_level);
-    mlfq_data[tcb->tid].quantum_used = 0;
-    printf("tid%d demoted from tid%d to tid%d\n", tcb->tid, old, new_level);
-}
-
-void promote_on_new_burst(thread_control_block_t* tcb) {
-    mlfq_data[tcb->tid].level = 0;
-    mlfq_data[tcb->tid].quantum_used = 0;
-    enqueue_mlfq(tcb, 0);
-}
-
-// void print_mlfq_state() {
-//     for (int lvl = 0; lvl < 5; lvl++) {
-//         printf("Level %d (quantum=%d): ", lvl, MLFQ_TIME_QUANTUM[lvl]);
-
-//         if (mlfq[lvl].count == 0) {
-//             printf("[empty]\n");
-//             continue;
-//         }
-
-//         // Iterate circularly over queue
-//         for (int i = 0; i < mlfq[lvl].count; i++) {
-//             int idx = (mlfq[lvl].front + i) % MAX_THREADS;
-//             thread_control_block_t* t = mlfq[lvl].threads[idx];
-//             printf("T%d(quantum_used=%d)(ready_arrival=%f)", 
-//                    t->tid, mlfq_data[t->tid].quantum_used, t->ready_arrival_tick);
-//         }
-//         printf("\n");
-//     }
-// }
-
-thread_control_block_t* select_next_thread_mlfq() {
-    queue_t temp[5];
-    for (int i = 0; i < 5; i++) {
-        init_queue(&temp[i]);
+// Back to value 0 with no waiters for the next run. The semaphores stay in
+// the table with their heaps, a batch of runs mostly uses the same ids.
+void clear_semaphores(sem_table_t* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->slots[i] == NULL) continue;
+        table->slots[i]->value = 0;
+        clear_heap(&table->slots[i]->blocked);
     }
+}
 
-    for (int lvl = 0; lvl < 5; lvl++) {
-        for (int i = 0; i < mlfq[lvl].count; i++) {
-            int idx = (mlfq[lvl].front + i) % MAX_THREADS;
-            thread_control_block_t* t = mlfq[lvl].threads[idx];
-            if (t->ready_arrival_tick <= global_time) {
-                enqueue(&temp[lvl], t);
-                printf("T%d from L%d added to temp queue (ready tick %.1f <= global %d)\n",
-                       t->tid, lvl, t->ready_arrival_tick, global_time);
-            }
-        }
+void free_semaphores(sem_table_t* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->slots[i] == NULL) continue;
+        free_heap(&table->slots[i]->blocked);
+        free(table->slots[i]);
     }
+    table->count = 0;
+    free(table->slots);
+    table->slots = NULL;
+    table->capacity = 0;
+}
 
-    for (int lvl = 0; lvl < 5; lvl++) {
-        if (temp[lvl].count > 0) {
-            thread_control_block_t* next = select_next_thread_fcfs(&temp[lvl]);
-            mlfq_data[next->tid].level = lvl;
-            printf("Picked T%d from level %d (quantum %d)\n",
-                   next->tid, lvl, MLFQ_TIME_QUANTUM[lvl]);
-            return next;
-        }
+static void process_p(thread_control_block_t* tcb) {
+    sched_ctx_t* ctx = tcb->ctx;
+    semaphore_t* sem = find_semaphore(&ctx->semaphores, tcb->op_arg);
+
+    if (sem->value > 0) {
+        // P returns instantly at call's integer tick
+        sem->value--;
+        release_thread(tcb, ctx->global_time);
+    } else {
+        // Add this thread to the semaphore's waiting list.
+        tcb->state = STATE_BLOCKED_SEM;
+        emit_event(SCH_EVENT_BLOCK, tcb, ctx->global_time, ctx->global_time, tcb->op_arg);
+        metrics_block(ctx, tcb->slot, ctx->global_time);
+        heap_push(&sem->blocked, tcb);
     }
+}
 
-    int earliest_tick = INT_MAX;
-    thread_control_block_t* earliest_thread = NULL;
-    for (int lvl = 0; lvl < 5; lvl++) {
-        for (int i = 0; i < mlfq[lvl].count; i++) {
-            int idx = (mlfq[lvl].front + i) % MAX_THREADS;
-            thread_control_block_t* t = mlfq[lvl].threads[idx];
-            if (ceil(t->ready_arrival_tick) < earliest_tick || (ceil(t->ready_arrival_tick) == earliest_tick && t->tid < earliest_thread->tid)) {
-                earliest_tick = ceil(t->ready_arrival_tick);
-                earliest_thread = t;
-            }
-        }
+static void process_v(thread_control_block_t* tcb) {
+    sched_ctx_t* ctx = tcb->ctx;
+    semaphore_t* sem = find_semaphore(&ctx->semaphores, tcb->op_arg);
+
+    if (sem->blocked.count > 0) {
+        // Wake the thread with the lowest tid
+        thread_control_block_t* tcb_to_wake = heap_pop(&sem->blocked);
+        tcb_to_wake->state = STATE_READY;
+        emit_event(SCH_EVENT_WAKE, tcb_to_wake, ctx->global_time, ctx->global_time, tcb->op_arg);
+        metrics_wake(ctx, tcb_to_wake->slot, ctx->global_time);
+        release_thread(tcb_to_wake, ctx->global_time);
+    } else {
+        sem->value++;
+    }
+
+    release_thread(tcb, ctx->global_time);
+}
+
+// The thread called end_me() and never publishes again
+static void process_end(thread_control_block_t* tcb) {
+    sched_ctx_t* ctx = tcb->ctx;
+    tcb->state = STATE_TERMINATED;
+    emit_event(SCH_EVENT_END, tcb, ctx->global_time, ctx->global_time, -1);
+    metrics_end(ctx, tcb->slot, ctx->global_time);
+    if (tcb->core != -1 && ctx->cores[tcb->core].current == tcb) {
+        ctx->cores[tcb->core].current = NULL;
     }
+    retire_thread(tcb);
+}
 
-    if (earliest_thread != NULL) {
-        printf("No thread ready. Advancing time to earliest arrival - T%d, tick %f)\n",
-               earliest_thread->tid, earliest_thread->ready_arrival_tick);
-        advance_time_to(ceil(earliest_thread->ready_arrival_tick));
-        return earliest_thread;
+static void process_op(thread_control_block_t* tcb) {
+    sched_ctx_t* ctx = tcb->ctx;
+    if (tcb->op != OP_END) metrics_arrive(ctx, tcb->slot, tcb->op_time);
+    switch (tcb->op) {
+        case OP_IO:
+            TRACE_EVENT(TRACE_CALL_IO, tcb->tid, ctx->global_time, tcb->op_arg, tcb->io_device);
+            process_io(tcb);
+            break;
+        case OP_P:
+            TRACE_EVENT(TRACE_CALL_P, tcb->tid, ctx->global_time, tcb->op_arg, 0);
+            process_p(tcb);
+            break;
+        case OP_V:
+            TRACE_EVENT(TRACE_CALL_V, tcb->tid, ctx->global_time, tcb->op_arg, 0);
+            process_v(tcb);
+            break;
+        case OP_END:
+            TRACE_EVENT(TRACE_CALL_END, tcb->tid, ctx->global_time, 0, 0);
+            process_end(tcb);
+            break;
+        default: break;
     }
+}
 
-    return NULL;
+// Wake the thread up, its call returns return_time
+static void release_to_thread(thread_control_block_t* tcb) {
+    sched_ctx_t* ctx = tcb->ctx;
+    if (ctx->fibers.active) {
+        fiber_wake(tcb);
+        return;
+    }
+    pthread_mutex_lock(&tcb->lock);
+    tcb->released = true;
+    pthread_cond_signal(&tcb->cond);
+    pthread_mutex_unlock(&tcb->lock);
 }
 
-void barrier_wait() {
-    arrived_count++;
-    printf("Arrived thread Count: %d\n", arrived_count);
-    if (arrived_count < active_threads) {
-        pthread_cond_wait(&barrier_cond, &scheduler_mutex);
+// Hand the call back to the thread, it returns event_time from the API.
+static void complete_event(thread_control_block_t* tcb) {
+    sched_ctx_t* ctx = tcb->ctx;
+    int64_t time = tcb->event_time;
+    if (tcb->op == OP_CPU) {
+        if (tcb->core != -1 && ctx->cores[tcb->core].current == tcb) ctx->cores[tcb->core].current = NULL;
+        tcb->state = STATE_READY;
+        // The call that only reports the end of a burst did not run
+        if (tcb->op_arg > 0) emit_event(SCH_EVENT_CPU, tcb, time - 1, time, -1);
+    } else if (tcb->op == OP_IO) {
+        io_device_t* dev = &ctx->io_devices[tcb->io_device];
+        if (dev->current == tcb) dev->current = NULL;
+        emit_event(SCH_EVENT_IO_DONE, tcb, time, time, -1);
+    } else if (tcb->op == OP_P) {
+        emit_event(SCH_EVENT_P, tcb, time, time, tcb->op_arg);
+    } else if (tcb->op == OP_V) {
+        emit_event(SCH_EVENT_V, tcb, time, time, tcb->op_arg);
+    }
+    tcb->return_time = tcb->event_time;
+    TRACE_EVENT(TRACE_RETURN, tcb->tid, ctx->global_time, 0, 0);
+    // Counted before the thread can run and publish again
+    atomic_fetch_add_explicit(&ctx->unpublished_count, 1, memory_order_relaxed);
+    release_to_thread(tcb);
+}
+
+// Move the operations published since the last call onto the calendar. The
+// simulation cannot move past the tick the threads were released at before
+// they published, so that tick is the earliest the operation can happen.
+static void collect_published_ops(sched_ctx_t* ctx) {
+    thread_control_block_t* tcb = atomic_exchange_explicit(&ctx->published_ops, NULL, memory_order_acquire);
+    while (tcb != NULL) {
+        thread_control_block_t* next = tcb->published_next;
+        int64_t tick = time_tick(tcb->op_time);
+        if (tcb->op == OP_END || tick < ctx->global_time) tick = ctx->global_time;
+        schedule_event(tcb, EVENT_OP, tick);
+        tcb = next;
+    }
+}
+
+// Cores
+// Every core applies the policy to its own run queue. A ready thread stays
+// on the core it last ran on, new threads go to the least loaded core, and a
+// core that finds its queue empty steals from the core with the most
+// waiting threads. Running on another core than last time costs the thread
+// migration_cost extra ticks before its tick.
+
+#define POLICY fcfs
+#include "engine.h"
+#define POLICY srtf
+#include "engine.h"
+#define POLICY mlfq
+#include "engine.h"
+#define POLICY cfs
+#include "engine.h"
+#define POLICY ext
+#include "engine.h"
+
+// Pick the simulation loop of the run's policy. Must be called with
+// ctx->mutex held.
+void set_simulation(sched_ctx_t* ctx) {
+    if (ctx->policy != NULL) {
+        ctx->simulate = run_simulation_ext;
+        return;
+    }
+    switch (ctx->scheduler_type) {
+        case SCH_FCFS: ctx->simulate = run_simulation_fcfs; break;
+        case SCH_SRTF: ctx->simulate = run_simulation_srtf; break;
+        case SCH_MLFQ: ctx->simulate = run_simulation_mlfq; break;
+        case SCH_CFS: ctx->simulate = run_simulation_cfs; break;
+        default:
+            TRACE_ERROR("Error: Unknown scheduler type, using FCFS\n");
+            ctx->simulate = run_simulation_fcfs;
+            break;
+    }
+}
+
+// The thread is back in the library, the last one to come back runs the
+// simulation
+static void enter_library(sched_ctx_t* ctx) {
+    if (atomic_fetch_sub_explicit(&ctx->unpublished_count, 1, memory_order_acq_rel) == 1) {
+        pthread_mutex_lock(&ctx->mutex);
+        ctx->simulate(ctx);
+        pthread_mutex_unlock(&ctx->mutex);
+    }
+}
+
+// Hand the operation set up in tcb to the scheduler, without holding a lock.
+// The last thread to publish runs the simulation.
+void publish(thread_control_block_t* tcb) {
+    sched_ctx_t* ctx = tcb->ctx;
+    thread_control_block_t* head = atomic_load_explicit(&ctx->published_ops, memory_order_relaxed);
+    do {
+        tcb->published_next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&ctx->published_ops, &head, tcb,
+                                                    memory_order_release, memory_order_relaxed));
+    enter_library(ctx);
+}
+
+// Block until the scheduler returns the thread's call
+static sch_time_t wait_release(thread_control_block_t* tcb) {
+    sched_ctx_t* ctx = tcb->ctx;
+    if (ctx->fibers.active) {
+        fiber_wait(tcb);
     } else {
-        // Last thread to arrive resets counter and wakes all
-        pthread_cond_broadcast(&barrier_cond);
+        pthread_mutex_lock(&tcb->lock);
+        while (!tcb->released) {
+            pthread_cond_wait(&tcb->cond, &tcb->lock);
+        }
+        pthread_mutex_unlock(&tcb->lock);
     }
+    return tcb->return_time * SCH_TIME_FRAC;
+}
+
+// Publish the thread's next operation and block until the scheduler returns it.
+sch_time_t publish_op(thread_control_block_t* tcb, op_type_t op, sch_time_t current_time, int arg) {
+    tcb->op = op;
+    tcb->op_time = current_time;
+    tcb->op_arg = arg;
+    tcb->released = false;
+    publish(tcb);
+    return wait_release(tcb);
+}
+
+// A restored thread was in a call at the checkpoint, its operation is
+// already known to the scheduler. Wait for that call to return.
+sch_time_t resume_op(thread_control_block_t* tcb) {
+    tcb->resume = false;
+    enter_library(tcb->ctx);
+    return wait_release(tcb);
 }
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stddef.h>
 #include <stdarg.h>
 #include <string.h>
@@ -11,10 +12,17 @@
 #include <limits.h>
 #include <float.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "api.h"
+#include "trace.h"
+#include "metrics.h"
 
-#define MAX_THREADS 128
+#define FIBER_STACK_SIZE (64 * 1024)
+#define CFS_NICE_0_WEIGHT 1024
+#define CFS_TICK_VRUNTIME 1024  // vruntime of one tick at nice 0
+
+typedef struct sched_ctx sched_ctx_t;
 
 // Thread states
 typedef enum {
@@ -25,16 +33,67 @@ typedef enum {
     STATE_TERMINATED
 } thread_state_t;
 
+// Operation a thread has published to the scheduler
+typedef enum {
+    OP_NONE,
+    OP_CPU,
+    OP_IO,
+    OP_P,
+    OP_V,
+    OP_END
+} op_type_t;
+
+// Kind of event a thread has on the event calendar
+typedef enum {
+    EVENT_RELEASE,   // return from the current call at event_time
+    EVENT_OP         // process the published operation at event_time
+} event_type_t;
+
 // Thread Control Block
-typedef struct {
+typedef struct thread_control_block {
+    sched_ctx_t* ctx;   // instance the thread belongs to
     int tid;
-    float arrival_time;
+    int slot;           // index of the thread's entry in the per-thread arrays
     int remaining_time;
-    float ready_arrival_tick;
+    sch_time_t ready_time;  // call time of the CPU burst, orders FCFS and MLFQ
     int last_cpu_remaining;
-    int wake_time;
     thread_state_t state;
+
+    // Release handshake with the thread, see release_to_thread()
+    pthread_mutex_t lock;
     pthread_cond_t cond;
+
+    // Published operation and the next simulated time it affects the scheduler
+    op_type_t op;
+    sch_time_t op_time;
+    int op_arg;
+    event_type_t event_type;
+    int64_t event_time;
+    struct thread_control_block* published_next;  // next on the published_ops stack
+
+    // Set when the scheduler hands the call back to the thread
+    bool released;
+    int64_t return_time;
+
+    // I/O device of the current io_me() call and order among its requests
+    int io_device;
+    uint64_t io_seq;
+
+    // Index in the heaps holding this thread, -1 if absent
+    int heap_pos[3];
+
+    // Core whose run queue holds the thread and core it last ran on, -1 if none
+    int core;
+    int last_core;
+
+    struct fiber* fiber;    // fiber running the thread in fiber mode
+
+    // Where replay_thread() is in the workload: the op of the current call
+    // and, for a CPU burst, the remaining_time it passed. replay_op is
+    // UINT64_MAX for a thread not run by replay_thread().
+    uint64_t replay_op;
+    int replay_left;
+    bool resume;            // restored, picks up inside its call, see checkpoint.c
 } thread_control_block_t;
 
 typedef struct {
@@ -42,60 +101,273 @@ typedef struct {
     int quantum_used;   // ticks used in current level
 } mlfq_info_t;
 
-// Semaphore structure
 typedef struct {
-    int value;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-    thread_control_block_t* blocked_threads[MAX_THREADS];
-    int blocked_count;
-} semaphore_t;
+    int64_t vruntime;   // weighted CPU time, CFS_TICK_VRUNTIME per tick at nice 0
+    int weight;         // from the nice value
+    int core;           // core whose min_vruntime vruntime is measured against, -1 if none yet
+    bool waking;        // starts a new burst, placed on the next enqueue
+} cfs_info_t;
 
-// Queue structure
+// Queue structure, a ring buffer that grows on demand
 typedef struct {
-    thread_control_block_t* threads[MAX_THREADS];
+    thread_control_block_t** threads;
+    int capacity;
     int front;
     int rear;
     int count;
 } queue_t;
 
-// Global variables
-extern int global_time;
-extern int global_IO_time;
-extern enum sch_type scheduler_type;
-extern int thread_count;
-extern pthread_mutex_t scheduler_mutex;
-
-extern int active_threads;
-extern int arrived_count;    // number of threads still alive (not terminated)
-extern pthread_cond_t barrier_cond;
-extern pthread_cond_t timeCond;
-extern int blocked_on_p_count;
-
-extern thread_control_block_t* tcb_array;
-extern queue_t ready_queue;
-extern queue_t io_queue;
-extern semaphore_t semaphores[MAX_NUM_SEM];
-extern queue_t mlfq[5];
-extern mlfq_info_t mlfq_data[MAX_THREADS];
-
-extern thread_control_block_t* current_cpu_thread;
-extern thread_control_block_t* current_io_thread;
+typedef bool (*heap_less_fn)(const thread_control_block_t* a, const thread_control_block_t* b);
+
+// Which heap_pos slot of the TCB a heap uses. A thread is on the event
+// calendar, in at most one ready heap and waits on at most one device or
+// semaphore at a time.
+typedef enum {
+    HEAP_SLOT_EVENT,
+    HEAP_SLOT_READY,
+    HEAP_SLOT_WAIT
+} heap_slot_t;
+
+// Indexed binary min-heap of TCBs, grows on demand
+typedef struct {
+    thread_control_block_t** threads;
+    int capacity;
+    int count;
+    heap_slot_t slot;
+    heap_less_fn less;
+} heap_t;
+
+// A simulated CPU with its own run queue for each policy
+typedef struct {
+    int id;
+    thread_control_block_t* current;  // thread granted the current tick
+    queue_t ready_queue;              // FCFS ready threads
+    heap_t srtf_heap;                 // SRTF ready threads ordered by (remaining_time, tid)
+    heap_t mlfq[MLFQ_MAX_LEVELS];
+    unsigned int mlfq_bitmap;         // bit lvl set while mlfq[lvl] is non-empty
+    heap_t cfs_heap;                  // CFS ready threads ordered by (vruntime, tid)
+    int64_t min_vruntime;             // never decreases, new and waking threads start near it
+    int64_t cfs_load;                 // sum of the weights in cfs_heap
+    thread_control_block_t* cfs_curr; // thread running its slice
+    int slice_used;                   // ticks cfs_curr had in its slice
+} core_t;
+
+// Semaphore structure
+typedef struct {
+    int id;
+    int value;
+    heap_t blocked;      // threads blocked in P, lowest tid first
+} semaphore_t;
+
+// Semaphores by id, open addressing with linear probing. Semaphores are
+// allocated one by one so pointers to them stay valid when the table grows.
+typedef struct {
+    semaphore_t** slots;
+    int capacity;        // power of two
+    int count;
+} sem_table_t;
+
+// A simulated I/O device, serves one request at a time
+typedef struct {
+    int id;
+    enum io_discipline discipline;
+    heap_t requests;                  // waiting requests in discipline order
+    thread_control_block_t* current;  // request being served
+    int64_t time;                     // device clock, busy until this time
+} io_device_t;
+
+// Worker threads and fibers of run_fibers(), see fiber.c
+typedef struct {
+    bool active;                // threads are fibers run by run_fibers()
+    struct fiber** fibers;      // stacks are kept for the next run
+    int count;
+    int capacity;
+    struct fiber** idle;        // fibers not running a thread
+    int idle_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    queue_t run_queue;          // fibers whose call has returned
+    int left;                   // threads that have not returned from entry
+    fiber_entry_fn entry;
+    void* arg;
+} fiber_pool_t;
+
+// Threads admitted by sched_run_stream(), see stream.c
+typedef struct {
+    const struct sch_workload* workload;  // NULL outside a stream run
+    bool in_order;              // the workload lists threads by arrival time
+    int* order;                 // tids by arrival otherwise
+    int order_capacity;
+    int next;                   // arrival order position of the next thread
+    thread_control_block_t** table;  // live threads by tid, linear probing
+    int table_capacity;         // power of two
+    int live;
+    int* free_slots;            // slots of ended threads
+    int free_count;
+    int free_capacity;
+} stream_t;
+
+// Scheduler instance
+// Everything a simulation touches lives here, so instances are independent
+// and can run concurrently. The arrays keep their capacity when an instance
+// is reset for the next run.
+//
+// Locking
+// Threads publish operations without taking a lock: the operation is pushed
+// on published_ops and unpublished_count is decremented. Only the thread that
+// brings unpublished_count to 0 takes the instance's mutex and runs the
+// simulation, so a call that does not complete a tick never waits for
+// dispatch. Locks, always taken in this order:
+//   1. ctx->mutex       simulation state: calendar, time, cores, I/O devices,
+//                       semaphores, event listener, metrics. Held by
+//                       run_simulation(), reset/finish and configuration calls.
+//   2. tcb->lock        released/return_time of one thread, thread mode
+//      fibers.mutex     fiber run queue and parked fibers, fiber mode
+// No lock is held while a thread runs user code or waits for its call.
+struct sched_ctx {
+    pthread_mutex_t mutex;
+    int64_t global_time;
+    enum sch_type scheduler_type;
+    int thread_count;
+
+    atomic_int unpublished_count;    // threads running outside the library
+    thread_control_block_t* _Atomic published_ops;  // published, not yet on the calendar
+    heap_t event_queue;              // threads ordered by (event_time, event_type, tid)
+
+    // Per-thread state by slot. Outside a stream run thread tid is in slot
+    // tid, TCBs are allocated one by one so pointers to them stay valid.
+    thread_control_block_t** threads;
+    mlfq_info_t* mlfq_data;
+    cfs_info_t* cfs_data;
+    int slot_count;                  // slots handed out in this run
+    int thread_capacity;             // allocated entries of the per-thread arrays
+    stream_t stream;
+
+    io_device_t* io_devices;
+    int io_device_count;
+    int io_device_capacity;
+    uint64_t io_request_seq;         // io_seq of the next I/O request
+    sem_table_t semaphores;
+
+    struct sch_mlfq_config mlfq;
+    int64_t next_boost;              // time of the next MLFQ boost, if enabled
+    struct sch_cfs_config cfs;
+
+    // Simulation loop specialized for the policy, see engine.h
+    void (*simulate)(sched_ctx_t* ctx);
+    const struct sch_policy* policy; // set_policy() policy, NULL for a built-in one
+    void* policy_state;
+
+    core_t* cores;
+    int core_count;
+    int core_capacity;
+    int migration_cost;              // extra ticks a thread pays to run on a new core
+
+    sch_event_fn event_listener;
+    void* event_listener_arg;
+    uint64_t event_seq;              // seq of the next emitted event
+
+    metrics_t metrics;
+    fiber_pool_t fibers;
+
+    int64_t checkpoint_time;         // INT64_MAX if no checkpoint is due
+    char* checkpoint_path;
+};
+
+// Instance of the API calls without a sched_ prefix
+extern sched_ctx_t* default_ctx;
+
 
 // Functions
+void* checked_realloc(void* ptr, size_t size);
 void init_queue(queue_t* q);
+void free_queue(queue_t* q);
+void clear_queue(queue_t* q);
 void enqueue(queue_t* q, thread_control_block_t* tcb);
 thread_control_block_t* dequeue(queue_t* q);
 thread_control_block_t* dequeue_at_index(queue_t* q, int absolute_index);
 void dequeue_tid_from_q(queue_t* q, int tid);
 thread_control_block_t* peek(queue_t* q);
-void advance_time_to(int target_time);
-void advance_IO_time_to(int target_time);
-thread_control_block_t* select_next_thread();
+int64_t time_tick(sch_time_t time);
+void advance_time_to(sched_ctx_t* ctx, int64_t target_time);
 thread_control_block_t* select_next_thread_fcfs(queue_t* q);
-thread_control_block_t* select_next_thread_srtf();
-thread_control_block_t* select_next_thread_mlfq();
+bool srtf_less(const thread_control_block_t* a, const thread_control_block_t* b);
+bool mlfq_less(const thread_control_block_t* a, const thread_control_block_t* b);
+bool cfs_less(const thread_control_block_t* a, const thread_control_block_t* b);
+int cfs_nice_weight(int nice);
 void enqueue_mlfq(thread_control_block_t* tcb, int level);
+void dequeue_mlfq(thread_control_block_t* tcb);
 void demote_mlfq_thread(thread_control_block_t* tcb);
-void promote_on_new_burst(thread_control_block_t* tcb);
-void barrier_wait();
\ No newline at end of file
+bool io_fifo_less(const thread_control_block_t* a, const thread_control_block_t* b);
+bool io_shortest_less(const thread_control_block_t* a, const thread_control_block_t* b);
+bool io_priority_less(const thread_control_block_t* a, const thread_control_block_t* b);
+void init_io_device(io_device_t* dev, int id, enum io_discipline discipline);
+bool sem_waiter_less(const thread_control_block_t* a, const thread_control_block_t* b);
+semaphore_t* find_semaphore(sem_table_t* table, int sem_id);
+void clear_semaphores(sem_table_t* table);
+void free_semaphores(sem_table_t* table);
+void init_heap(heap_t* h, heap_slot_t slot, heap_less_fn less);
+void free_heap(heap_t* h);
+void clear_heap(heap_t* h);
+void heap_push(heap_t* h, thread_control_block_t* tcb);
+thread_control_block_t* heap_pop(heap_t* h);
+thread_control_block_t* heap_peek(heap_t* h);
+thread_control_block_t* heap_peek_except(heap_t* h, thread_control_block_t* skip);
+void heap_remove(heap_t* h, thread_control_block_t* tcb);
+void heap_update(heap_t* h, thread_control_block_t* tcb);
+bool heap_contains(heap_t* h, thread_control_block_t* tcb);
+sch_time_t publish_op(thread_control_block_t* tcb, op_type_t op, sch_time_t current_time, int arg);
+sch_time_t resume_op(thread_control_block_t* tcb);
+bool event_less(const thread_control_block_t* a, const thread_control_block_t* b);
+void run_simulation_fcfs(sched_ctx_t* ctx);
+void run_simulation_srtf(sched_ctx_t* ctx);
+void run_simulation_mlfq(sched_ctx_t* ctx);
+void run_simulation_cfs(sched_ctx_t* ctx);
+void run_simulation_ext(sched_ctx_t* ctx);
+void set_simulation(sched_ctx_t* ctx);
+void drop_policy(sched_ctx_t* ctx);
+void emit_event(enum sch_event_type type, thread_control_block_t* tcb, int64_t start, int64_t end, int sem_id);
+void publish(thread_control_block_t* tcb);
+void fiber_wait(thread_control_block_t* tcb);
+void fiber_wake(thread_control_block_t* tcb);
+void init_fiber_pool(fiber_pool_t* pool);
+void free_fiber_pool(fiber_pool_t* pool);
+void start_fiber(fiber_pool_t* pool, thread_control_block_t* tcb);
+void reserve_slots(sched_ctx_t* ctx, int count);
+void init_thread(sched_ctx_t* ctx, int slot, int tid);
+thread_control_block_t* find_thread(sched_ctx_t* ctx, int tid);
+void begin_stream(sched_ctx_t* ctx, const struct sch_workload* workload);
+bool admit_arrivals(sched_ctx_t* ctx);
+int64_t next_arrival(sched_ctx_t* ctx);
+void retire_thread(thread_control_block_t* tcb);
+void init_stream(stream_t* stream);
+void free_stream(stream_t* stream);
+void set_io_devices(sched_ctx_t* ctx, int device_count, const enum io_discipline* disciplines);
+void write_checkpoint(sched_ctx_t* ctx);
+
+// Policy operations, see policy.c. X is fcfs, srtf, mlfq, cfs or ext, the last
+// one calling the set_policy() callbacks:
+//   void X_enqueue(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb);
+//   thread_control_block_t* X_pick_next(sched_ctx_t* ctx, core_t* core);
+//   thread_control_block_t* X_pick_except(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb);
+//   void X_on_tick(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb);
+//   void X_on_block(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb);
+//   void X_on_wake(sched_ctx_t* ctx, thread_control_block_t* tcb);
+//   int X_count(sched_ctx_t* ctx, core_t* core);
+//   bool X_queued(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb);
+//   void X_on_time(sched_ctx_t* ctx);
+#define POLICY_OPS(X) \
+    void X##_enqueue(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb); \
+    thread_control_block_t* X##_pick_next(sched_ctx_t* ctx, core_t* core); \
+    thread_control_block_t* X##_pick_except(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb); \
+    void X##_on_tick(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb); \
+    void X##_on_block(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb); \
+    void X##_on_wake(sched_ctx_t* ctx, thread_control_block_t* tcb); \
+    int X##_count(sched_ctx_t* ctx, core_t* core); \
+    bool X##_queued(sched_ctx_t* ctx, core_t* core, thread_control_block_t* tcb); \
+    void X##_on_time(sched_ctx_t* ctx);
+POLICY_OPS(fcfs)
+POLICY_OPS(srtf)
+POLICY_OPS(mlfq)
+POLICY_OPS(cfs)
+POLICY_OPS(ext)
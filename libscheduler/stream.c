@@ -0,0 +1,216 @@
+#include "api.h"
+#include "scheduler.h"
+
+// Stream runs
+// Outside a stream run every thread has a slot from the start and thread tid
+// is in slot tid. A stream run starts with no threads: the simulation starts
+// a thread when it reaches the thread's arrival time, at the top of a tick
+// so its first call is on the calendar before anything else happens at that
+// tick, and the thread's slot and fiber are reused once it ends. The order
+// of events is the same as if every thread had been there from the start.
+// Live threads are found by tid in a hash table.
+
+static unsigned int tid_slot(int tid, int capacity) {
+    return ((unsigned int)tid * 2654435761u) & (capacity - 1);
+}
+
+static void table_insert(stream_t* stream, thread_control_block_t* tcb) {
+    unsigned int i = tid_slot(tcb->tid, stream->table_capacity);
+    while (stream->table[i] != NULL) {
+        i = (i + 1) & (stream->table_capacity - 1);
+    }
+    stream->table[i] = tcb;
+}
+
+// Keep the load factor at most 1/2
+static void grow_table(stream_t* stream) {
+    int old_capacity = stream->table_capacity;
+    thread_control_block_t** old_table = stream->table;
+    stream->table_capacity = old_capacity > 0 ? old_capacity * 2 : 64;
+    stream->table = checked_realloc(NULL, sizeof(*stream->table) * stream->table_capacity);
+    memset(stream->table, 0, sizeof(*stream->table) * stream->table_capacity);
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_table[i] != NULL) table_insert(stream, old_table[i]);
+    }
+    free(old_table);
+}
+
+// Linear probing without tombstones: entries after the removed one move
+// back if their probe sequence passes through the hole
+static void table_remove(stream_t* stream, thread_control_block_t* tcb) {
+    unsigned int mask = stream->table_capacity - 1;
+    unsigned int hole = tid_slot(tcb->tid, stream->table_capacity);
+    while (stream->table[hole] != tcb) {
+        hole = (hole + 1) & mask;
+    }
+    unsigned int i = hole;
+    while (true) {
+        i = (i + 1) & mask;
+        if (stream->table[i] == NULL) break;
+        unsigned int home = tid_slot(stream->table[i]->tid, stream->table_capacity);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            stream->table[hole] = stream->table[i];
+            hole = i;
+        }
+    }
+    stream->table[hole] = NULL;
+}
+
+thread_control_block_t* find_thread(sched_ctx_t* ctx, int tid) {
+    stream_t* stream = &ctx->stream;
+    if (stream->workload == NULL) return ctx->threads[tid];
+    if (stream->table_capacity == 0) return NULL;
+    unsigned int i = tid_slot(tid, stream->table_capacity);
+    while (stream->table[i] != NULL) {
+        if (stream->table[i]->tid == tid) return stream->table[i];
+        i = (i + 1) & (stream->table_capacity - 1);
+    }
+    return NULL;
+}
+
+// Tick of the thread's first call, as collect_published_ops() rounds it
+static int64_t arrival_tick(stream_t* stream, int tid) {
+    return time_tick(stream->workload->arrival[tid]);
+}
+
+static int next_tid(stream_t* stream) {
+    return stream->in_order ? stream->next : stream->order[stream->next];
+}
+
+struct arrival {
+    sch_time_t time;
+    int tid;
+};
+
+static int compare_arrivals(const void* a, const void* b) {
+    const struct arrival* x = a;
+    const struct arrival* y = b;
+    if (x->time != y->time) return x->time < y->time ? -1 : 1;
+    return x->tid - y->tid;
+}
+
+// Arrival order of the workload. Generated traces list threads by arrival
+// time and need no index.
+static void sort_arrivals(stream_t* stream) {
+    const struct sch_workload* workload = stream->workload;
+    int count = workload->thread_count;
+    int tid = 1;
+    while (tid < count && workload->arrival[tid - 1] <= workload->arrival[tid]) tid++;
+    stream->in_order = tid >= count;
+    if (stream->in_order) return;
+
+    struct arrival* arrivals = checked_realloc(NULL, sizeof(*arrivals) * count);
+    for (int i = 0; i < count; i++) {
+        arrivals[i].time = workload->arrival[i];
+        arrivals[i].tid = i;
+    }
+    qsort(arrivals, count, sizeof(*arrivals), compare_arrivals);
+    if (count > stream->order_capacity) {
+        stream->order = checked_realloc(stream->order, sizeof(int) * count);
+        stream->order_capacity = count;
+    }
+    for (int i = 0; i < count; i++) stream->order[i] = arrivals[i].tid;
+    free(arrivals);
+}
+
+void init_stream(stream_t* stream) {
+    memset(stream, 0, sizeof(*stream));
+}
+
+void free_stream(stream_t* stream) {
+    free(stream->order);
+    free(stream->table);
+    free(stream->free_slots);
+    init_stream(stream);
+}
+
+// Start a stream run of workload on an instance reset for 0 threads. Called
+// with ctx->mutex held, before any thread runs.
+void begin_stream(sched_ctx_t* ctx, const struct sch_workload* workload) {
+    stream_t* stream = &ctx->stream;
+    stream->workload = workload;
+    stream->next = 0;
+    stream->live = 0;
+    stream->free_count = 0;
+    if (stream->table_capacity > 0) {
+        memset(stream->table, 0, sizeof(*stream->table) * stream->table_capacity);
+    }
+    sort_arrivals(stream);
+
+    ctx->thread_count = workload->thread_count;
+    ctx->slot_count = 0;
+    atomic_store(&ctx->unpublished_count, 0);
+    metrics_init(ctx, 0);
+    metrics_stream_begin(ctx);
+
+    // A set_policy() policy was created for the threads of the reset
+    if (ctx->policy != NULL) {
+        const struct sch_policy* policy = ctx->policy;
+        drop_policy(ctx);
+        ctx->policy = policy;
+        ctx->policy_state = policy->create ? policy->create(ctx->thread_count, ctx->core_count) : NULL;
+    }
+}
+
+static void admit_thread(sched_ctx_t* ctx, int tid) {
+    stream_t* stream = &ctx->stream;
+    int slot;
+    if (stream->free_count > 0) {
+        slot = stream->free_slots[--stream->free_count];
+    } else {
+        slot = ctx->slot_count++;
+        reserve_slots(ctx, ctx->slot_count);
+    }
+    init_thread(ctx, slot, tid);
+    metrics_admit(ctx, slot, tid);
+
+    thread_control_block_t* tcb = ctx->threads[slot];
+    if (2 * (stream->live + 1) > stream->table_capacity) grow_table(stream);
+    table_insert(stream, tcb);
+    stream->live++;
+
+    // Outside the library until its first call, like a released thread
+    atomic_fetch_add_explicit(&ctx->unpublished_count, 1, memory_order_relaxed);
+    start_fiber(&ctx->fibers, tcb);
+}
+
+// Start every thread whose arrival tick the simulation has reached, returns
+// true if one was started. Called from run_simulation() with ctx->mutex held.
+bool admit_arrivals(sched_ctx_t* ctx) {
+    stream_t* stream = &ctx->stream;
+    if (stream->workload == NULL) return false;
+    bool admitted = false;
+    while (stream->next < ctx->thread_count) {
+        int tid = next_tid(stream);
+        if (arrival_tick(stream, tid) > ctx->global_time) break;
+        stream->next++;
+        admit_thread(ctx, tid);
+        admitted = true;
+    }
+    return admitted;
+}
+
+// Tick the next thread arrives at, INT64_MAX if none is left to admit
+int64_t next_arrival(sched_ctx_t* ctx) {
+    stream_t* stream = &ctx->stream;
+    if (stream->workload == NULL || stream->next >= ctx->thread_count) return INT64_MAX;
+    return arrival_tick(stream, next_tid(stream));
+}
+
+// The thread ended, its slot goes to the next thread that arrives. Nothing
+// may point at the TCB anymore.
+void retire_thread(thread_control_block_t* tcb) {
+    sched_ctx_t* ctx = tcb->ctx;
+    stream_t* stream = &ctx->stream;
+    if (stream->workload == NULL) return;
+    for (int c = 0; c < ctx->core_count; c++) {
+        if (ctx->cores[c].cfs_curr == tcb) ctx->cores[c].cfs_curr = NULL;
+    }
+    table_remove(stream, tcb);
+    stream->live--;
+    if (stream->free_count == stream->free_capacity) {
+        stream->free_capacity = stream->free_capacity > 0 ? stream->free_capacity * 2 : 16;
+        stream->free_slots = checked_realloc(stream->free_slots, sizeof(int) * stream->free_capacity);
+    }
+    stream->free_slots[stream->free_count++] = tcb->slot;
+}
@@ -0,0 +1,128 @@
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// One ring per OS thread. Only the owning thread writes a ring, so a record
+// is published with a single release store of head. Old records are
+// overwritten once the ring wraps.
+typedef struct trace_ring {
+    _Atomic uint64_t head;
+    uint32_t id;
+    unsigned int generation;
+    struct trace_ring* next;
+    trace_record_t records[TRACE_RING_SIZE];
+} trace_ring_t;
+
+atomic_bool trace_enabled = false;
+
+static char* trace_path = NULL;
+static _Atomic(trace_ring_t*) trace_rings = NULL;
+static _Atomic uint64_t trace_seq = 0;
+static _Atomic uint32_t trace_ring_count = 0;
+static _Atomic unsigned int trace_generation = 0;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int trace_users = 0;     // scheduler runs between trace_init() and trace_finish()
+static __thread trace_ring_t* local_ring = NULL;
+static __thread unsigned int local_generation = 0;
+
+// Runs of several scheduler instances share one trace, it starts with the
+// first run and is written when the last one finishes
+void trace_init() {
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_users++ == 0) {
+        const char* path = getenv("SCHED_TRACE");
+        if (path != NULL && path[0] != '\0') {
+            trace_path = strdup(path);
+            atomic_store_explicit(&trace_enabled, true, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+static trace_ring_t* trace_ring_for_thread() {
+    unsigned int generation = atomic_load_explicit(&trace_generation, memory_order_acquire);
+    // A ring from an earlier generation was freed by trace_finish()
+    if (local_ring != NULL && local_generation == generation) {
+        return local_ring;
+    }
+
+    trace_ring_t* ring = calloc(1, sizeof(trace_ring_t));
+    if (ring == NULL) return NULL;
+    ring->id = atomic_fetch_add_explicit(&trace_ring_count, 1, memory_order_relaxed);
+    ring->generation = generation;
+
+    // Lock-free push onto the list of rings
+    trace_ring_t* head = atomic_load_explicit(&trace_rings, memory_order_relaxed);
+    do {
+        ring->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&trace_rings, &head, ring,
+                                                    memory_order_release, memory_order_relaxed));
+    local_ring = ring;
+    local_generation = generation;
+    return ring;
+}
+
+void trace_record(trace_kind_t kind, int tid, int64_t time, int a, int b) {
+    trace_ring_t* ring = trace_ring_for_thread();
+    if (ring == NULL) return;
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_record_t* rec = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    rec->seq = atomic_fetch_add_explicit(&trace_seq, 1, memory_order_relaxed);
+    rec->kind = kind;
+    rec->tid = tid;
+    rec->time = time;
+    rec->a = a;
+    rec->b = b;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Write all rings to trace_path and drop them. Called once every thread is
+// done with the scheduler.
+void trace_finish() {
+    pthread_mutex_lock(&trace_mutex);
+    if (--trace_users > 0) {
+        pthread_mutex_unlock(&trace_mutex);
+        return;
+    }
+
+    trace_ring_t* ring = atomic_exchange_explicit(&trace_rings, NULL, memory_order_acquire);
+    atomic_fetch_add_explicit(&trace_generation, 1, memory_order_release);
+
+    FILE* fp = NULL;
+    if (trace_path != NULL) {
+        fp = fopen(trace_path, "wb");
+        if (fp == NULL) {
+            TRACE_ERROR("trace: cannot open %s\n", trace_path);
+        } else {
+            uint32_t version = TRACE_VERSION;
+            uint32_t record_size = sizeof(trace_record_t);
+            fwrite(TRACE_MAGIC, 1, 8, fp);
+            fwrite(&version, sizeof(version), 1, fp);
+            fwrite(&record_size, sizeof(record_size), 1, fp);
+        }
+    }
+
+    while (ring != NULL) {
+        trace_ring_t* next = ring->next;
+        if (fp != NULL) {
+            uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            uint32_t count = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+            fwrite(&ring->id, sizeof(ring->id), 1, fp);
+            fwrite(&count, sizeof(count), 1, fp);
+            for (uint64_t i = head - count; i < head; i++) {
+                fwrite(&ring->records[i & (TRACE_RING_SIZE - 1)], sizeof(trace_record_t), 1, fp);
+            }
+        }
+        free(ring);
+        ring = next;
+    }
+
+    if (fp != NULL) fclose(fp);
+    free(trace_path);
+    trace_path = NULL;
+    atomic_store_explicit(&trace_enabled, false, memory_order_relaxed);
+    pthread_mutex_unlock(&trace_mutex);
+}
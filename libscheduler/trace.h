@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Tracing
+// Text messages are filtered at compile time with TRACE_LEVEL, disabled
+// levels expand to nothing. Build with e.g. `make TRACE_LEVEL=3`.
+//
+// Binary events go to a lock-free ring buffer owned by the calling OS thread
+// and are written to the file named by $SCHED_TRACE once the last running
+// scheduler instance finishes.
+// Decode them with ./trace_decode <file>. Build with TRACE_RING=0 to compile
+// the events out.
+
+#define TRACE_LEVEL_NONE  0
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO  2
+#define TRACE_LEVEL_DEBUG 3
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_ERROR
+#endif
+
+#ifndef TRACE_RING
+#define TRACE_RING 1
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_ERROR(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define TRACE_ERROR(...) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_INFO(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define TRACE_INFO(...) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define TRACE_DEBUG(...) ((void)0)
+#endif
+
+// Binary trace events
+typedef enum {
+    TRACE_CALL_CPU,     // a = remaining_time
+    TRACE_CALL_IO,      // a = duration, b = device
+    TRACE_CALL_P,       // a = sem_id
+    TRACE_CALL_V,       // a = sem_id
+    TRACE_CALL_END,
+    TRACE_TIME,         // a = ticks skipped to the record's time
+    TRACE_DISPATCH,     // a = remaining_time, b = MLFQ level
+    TRACE_DEMOTE,       // a = old level, b = new level
+    TRACE_RETURN,       // the call returns at the record's time
+    TRACE_STEAL,        // a = core stolen from, b = stealing core
+    TRACE_BOOST,        // every MLFQ thread back to level 0
+    TRACE_KIND_COUNT
+} trace_kind_t;
+
+typedef struct {
+    uint64_t seq;       // global order across all rings
+    uint32_t kind;
+    int32_t tid;
+    int64_t time;       // simulated time when recorded
+    int32_t a;
+    int32_t b;
+} trace_record_t;
+
+#define TRACE_RING_SIZE 8192   // records per OS thread, power of two
+#define TRACE_MAGIC "SCHTRACE"
+#define TRACE_VERSION 2
+
+// File layout: magic[8], version u32, record size u32, then per ring:
+// ring id u32, record count u32, records oldest first.
+
+// Read on every record path, set by trace_init() and trace_finish()
+extern atomic_bool trace_enabled;
+
+void trace_init();
+void trace_finish();
+void trace_record(trace_kind_t kind, int tid, int64_t time, int a, int b);
+
+#if TRACE_RING
+#define TRACE_EVENT(kind, tid, time, a, b) \
+    do { \
+        if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) \
+            trace_record((kind), (tid), (time), (a), (b)); \
+    } while (0)
+#else
+#define TRACE_EVENT(kind, tid, time, a, b) ((void)0)
+#endif
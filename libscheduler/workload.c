@@ -0,0 +1,403 @@
+#include "api.h"
+#include "scheduler.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Workload loading
+// The text is parsed in a single pass straight from the mapped file into
+// the op array, lines can be of any length. Numbers are parsed in place, a
+// mapping has no terminating NUL to stop strtol() at. A compiled workload
+// is used straight from its mapping.
+
+#define MAX_ARRIVAL_LEN 64
+
+// Compiled workload file, the sections follow the header 8-byte aligned:
+//   sch_time_t arrival[thread_count]
+//   uint64_t first[thread_count + 1]
+//   struct sch_op ops[op_count]
+#define WORKLOAD_MAGIC 0x57484353u  // "SCHW" in little endian
+#define WORKLOAD_VERSION 2
+
+struct workload_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t thread_count;
+    uint32_t op_size;       // sizeof(struct sch_op)
+    uint64_t op_count;
+};
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+// Position in the mapped text for error messages
+struct cursor {
+    const char* path;
+    const char* p;
+    const char* end;
+    const char* line_start;
+    int line;
+};
+
+static void parse_error(const struct cursor* c, const char* at, const char* msg) {
+    TRACE_ERROR("%s:%d:%d: %s\n", c->path, c->line, (int)(at - c->line_start) + 1, msg);
+}
+
+static bool is_blank(char ch) {
+    return ch == ' ' || ch == '\t' || ch == '\r';
+}
+
+static bool at_token_end(const struct cursor* c) {
+    return c->p == c->end || is_blank(*c->p) || *c->p == '\n';
+}
+
+static void skip_blanks(struct cursor* c) {
+    while (c->p < c->end && is_blank(*c->p)) c->p++;
+}
+
+// Decimal integer in [min, max] at the cursor
+static bool parse_int(struct cursor* c, long min, long max, int* out) {
+    const char* start = c->p;
+    bool negative = c->p < c->end && *c->p == '-';
+    if (negative) c->p++;
+    long value = 0;
+    const char* digits = c->p;
+    while (c->p < c->end && *c->p >= '0' && *c->p <= '9') {
+        value = value * 10 + (*c->p - '0');
+        if (value > (long)INT_MAX + 1) {
+            parse_error(c, start, "number out of range");
+            return false;
+        }
+        c->p++;
+    }
+    if (c->p == digits) {
+        parse_error(c, start, "expected a number");
+        return false;
+    }
+    if (negative) value = -value;
+    if (value < min || value > max) {
+        parse_error(c, start, "number out of range");
+        return false;
+    }
+    *out = (int)value;
+    return true;
+}
+
+static void* grow(void* buf, size_t* cap, size_t needed, size_t size) {
+    if (needed <= *cap) return buf;
+    size_t new_cap = *cap ? *cap : 256;
+    while (new_cap < needed) new_cap *= 2;
+    *cap = new_cap;
+    return checked_realloc(buf, new_cap * size);
+}
+
+// One op token at the cursor, appended to the workload
+static bool parse_op(struct cursor* c, struct sch_workload* w) {
+    const char* start = c->p;
+    struct sch_op op = {0};
+    long min = 0;
+    long max = INT_MAX;
+    switch (*c->p) {
+        case 'C': op.type = SCH_OP_CPU; break;
+        case 'I': op.type = SCH_OP_IO; break;
+        case 'P': op.type = SCH_OP_P; min = INT_MIN; break;
+        case 'V': op.type = SCH_OP_V; min = INT_MIN; break;
+        case 'N': op.type = SCH_OP_NICE; min = -20; max = 19; break;
+        case 'E': op.type = SCH_OP_END; break;
+        default:
+            parse_error(c, start, "unknown operation, expected C, I, P, V, N or E");
+            return false;
+    }
+    c->p++;
+    if (op.type != SCH_OP_END) {
+        int arg;
+        if (!parse_int(c, min, max, &arg)) return false;
+        op.arg = arg;
+    }
+    if (op.type == SCH_OP_IO && c->p < c->end && *c->p == '@') {
+        c->p++;
+        int device;
+        if (!parse_int(c, 0, UINT16_MAX, &device)) return false;
+        op.device = device;
+    }
+    if (!at_token_end(c)) {
+        parse_error(c, c->p, "unexpected character");
+        return false;
+    }
+
+    w->op_buf = grow(w->op_buf, &w->op_cap, w->op_count + 1, sizeof(struct sch_op));
+    w->op_buf[w->op_count++] = op;
+    return true;
+}
+
+// One thread's line, the cursor is at its first non-blank character
+static bool parse_line(struct cursor* c, struct sch_workload* w) {
+    int tid = w->thread_count;
+
+    // Arrival time, copied out for strtod() and kept in fixed point
+    const char* start = c->p;
+    while (!at_token_end(c)) c->p++;
+    char arrival[MAX_ARRIVAL_LEN];
+    size_t len = c->p - start;
+    char* end = NULL;
+    double time = -1;
+    if (len < sizeof(arrival)) {
+        memcpy(arrival, start, len);
+        arrival[len] = '\0';
+        time = strtod(arrival, &end);
+    }
+    if (end != arrival + len || !(time >= 0 && time < (double)INT64_MAX / SCH_TIME_FRAC)) {
+        parse_error(c, start, "invalid arrival time");
+        return false;
+    }
+    w->arrival_buf = grow(w->arrival_buf, &w->arrival_cap, tid + 1, sizeof(sch_time_t));
+    w->arrival_buf[tid] = llround(time * SCH_TIME_FRAC);
+
+    // tids start from 0 and follow the line order
+    skip_blanks(c);
+    start = c->p;
+    int line_tid;
+    if (!parse_int(c, 0, INT_MAX, &line_tid)) return false;
+    if (line_tid != tid || !at_token_end(c)) {
+        parse_error(c, start, "incorrect tid");
+        return false;
+    }
+
+    w->first_buf = grow(w->first_buf, &w->first_cap, tid + 2, sizeof(uint64_t));
+    w->first_buf[tid] = w->op_count;
+    while (true) {
+        skip_blanks(c);
+        if (c->p == c->end || *c->p == '\n') {
+            parse_error(c, c->p, "thread does not end with E");
+            return false;
+        }
+        if (!parse_op(c, w)) return false;
+        if (w->op_buf[w->op_count - 1].type == SCH_OP_END) break;
+    }
+    skip_blanks(c);
+    if (c->p < c->end && *c->p != '\n') {
+        parse_error(c, c->p, "operation after E");
+        return false;
+    }
+    w->thread_count++;
+    w->first_buf[w->thread_count] = w->op_count;
+    return true;
+}
+
+// Drop the mapping of an earlier compiled workload
+static void release_map(struct sch_workload* workload) {
+    if (workload->map == NULL) return;
+    munmap(workload->map, workload->map_len);
+    workload->map = NULL;
+    workload->map_len = 0;
+}
+
+int workload_load_text(const char* path, struct sch_workload* workload) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        TRACE_ERROR("%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        TRACE_ERROR("%s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    const char* text = NULL;
+    if (st.st_size > 0) {
+        text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text == MAP_FAILED) {
+            TRACE_ERROR("%s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        madvise((void*)text, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    release_map(workload);
+    workload->thread_count = 0;
+    workload->op_count = 0;
+    struct cursor c = {path, text, text + st.st_size, text, 1};
+    int ret = 0;
+    while (c.p < c.end) {
+        skip_blanks(&c);
+        // Blank lines are skipped
+        if (c.p < c.end && *c.p != '\n' && !parse_line(&c, workload)) {
+            ret = -1;
+            break;
+        }
+        if (c.p < c.end) c.p++;  // the newline
+        c.line++;
+        c.line_start = c.p;
+    }
+    if (ret == 0 && workload->thread_count == 0) {
+        TRACE_ERROR("%s: no threads\n", path);
+        ret = -1;
+    }
+    if (text != NULL) munmap((void*)text, st.st_size);
+
+    workload->arrival = workload->arrival_buf;
+    workload->first = workload->first_buf;
+    workload->ops = workload->op_buf;
+    return ret;
+}
+
+int workload_save(const char* path, const struct sch_workload* workload) {
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        TRACE_ERROR("%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct workload_header header = {
+        .magic = WORKLOAD_MAGIC,
+        .version = WORKLOAD_VERSION,
+        .thread_count = workload->thread_count,
+        .op_size = sizeof(struct sch_op),
+        .op_count = workload->op_count,
+    };
+    static const char padding[8];
+    size_t arrival_len = sizeof(sch_time_t) * workload->thread_count;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(workload->arrival, 1, arrival_len, fp) == arrival_len &&
+              fwrite(padding, 1, align8(arrival_len) - arrival_len, fp) == align8(arrival_len) - arrival_len &&
+              fwrite(workload->first, sizeof(uint64_t), workload->thread_count + 1, fp) ==
+                  (size_t)workload->thread_count + 1 &&
+              fwrite(workload->ops, sizeof(struct sch_op), workload->op_count, fp) == workload->op_count;
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) {
+        TRACE_ERROR("%s: write failed\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Check what the simulation relies on without touching every op: the
+// offset table is in order and every thread ends with SCH_OP_END
+static bool check_compiled(const struct sch_workload* w) {
+    if (w->first[0] != 0 || w->first[w->thread_count] != w->op_count) return false;
+    for (int tid = 0; tid < w->thread_count; tid++) {
+        if (w->first[tid + 1] <= w->first[tid]) return false;
+        if (w->ops[w->first[tid + 1] - 1].type != SCH_OP_END) return false;
+        if (w->arrival[tid] < 0) return false;
+    }
+    return true;
+}
+
+int workload_load(const char* path, struct sch_workload* workload) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        TRACE_ERROR("%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct workload_header header;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != WORKLOAD_MAGIC) {
+        close(fd);
+        return workload_load_text(path, workload);
+    }
+    if (header.version != WORKLOAD_VERSION || header.op_size != sizeof(struct sch_op)) {
+        TRACE_ERROR("%s: unsupported compiled workload version %u\n", path, header.version);
+        close(fd);
+        return -1;
+    }
+
+    size_t first_offset = align8(sizeof(header) + sizeof(sch_time_t) * (size_t)header.thread_count);
+    size_t ops_offset = first_offset + sizeof(uint64_t) * ((size_t)header.thread_count + 1);
+    if (header.thread_count == 0 || header.thread_count > INT_MAX ||
+        header.op_count > (SIZE_MAX - ops_offset) / sizeof(struct sch_op) ||
+        (size_t)st.st_size != ops_offset + sizeof(struct sch_op) * header.op_count) {
+        TRACE_ERROR("%s: truncated or corrupt compiled workload\n", path);
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        TRACE_ERROR("%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    release_map(workload);
+    workload->map = map;
+    workload->map_len = st.st_size;
+    workload->thread_count = header.thread_count;
+    workload->op_count = header.op_count;
+    workload->arrival = (const sch_time_t*)((const char*)map + sizeof(header));
+    workload->first = (const uint64_t*)((const char*)map + first_offset);
+    workload->ops = (const struct sch_op*)((const char*)map + ops_offset);
+    if (!check_compiled(workload)) {
+        TRACE_ERROR("%s: corrupt compiled workload\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+void workload_free(struct sch_workload* workload) {
+    release_map(workload);
+    free(workload->arrival_buf);
+    free(workload->first_buf);
+    free(workload->op_buf);
+    memset(workload, 0, sizeof(*workload));
+}
+
+void sched_replay_thread(sched_ctx_t* ctx, const struct sch_workload* workload, int tid) {
+    thread_control_block_t* tcb = find_thread(ctx, tid);
+    // The first call of the thread is at its arrival time
+    sch_time_t schedule_time = workload->arrival[tid];
+    const struct sch_op* op = &workload->ops[workload->first[tid]];
+    int remaining = op->arg;    // CPU calls, one per tick, the last one with 0 ends the burst
+
+    // A restored thread goes on from the call it was in at the checkpoint
+    bool resume = tcb->resume;
+    if (resume) {
+        if (tcb->state == STATE_TERMINATED) return;
+        op = &workload->ops[tcb->replay_op];
+        remaining = tcb->replay_left;
+    }
+    while (true) {
+        if (resume) {
+            schedule_time = resume_op(tcb);
+            resume = false;
+        } else {
+            tcb->replay_op = op - workload->ops;
+            tcb->replay_left = remaining;
+            switch (op->type) {
+                case SCH_OP_CPU:
+                    schedule_time = sched_cpu_me(ctx, schedule_time, tid, remaining);
+                    break;
+                case SCH_OP_IO:
+                    schedule_time = sched_io_me_on(ctx, schedule_time, tid, op->arg, op->device);
+                    break;
+                case SCH_OP_P:
+                    schedule_time = sched_P(ctx, schedule_time, tid, op->arg);
+                    break;
+                case SCH_OP_V:
+                    schedule_time = sched_V(ctx, schedule_time, tid, op->arg);
+                    break;
+                case SCH_OP_NICE:
+                    sched_set_nice(ctx, tid, op->arg);
+                    break;
+                case SCH_OP_END:
+                    sched_end_me(ctx, tid);
+                    return;
+            }
+        }
+        // The next call follows without any time delay
+        if (op->type == SCH_OP_CPU && remaining > 0) {
+            remaining--;
+        } else {
+            op++;
+            remaining = op->arg;
+        }
+    }
+}
+
+void replay_thread(const struct sch_workload* workload, int tid) {
+    sched_replay_thread(default_ctx, workload, tid);
+}
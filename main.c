@@ -5,128 +5,276 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stddef.h>
-#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <time.h>
 
 #include "api.h"
 
-#define MAX_LINE_SIZE 1024
 #define MAX_LOG_SIZE 512
-#define MAX_LOG_LEN 4096
+#define LOG_CHUNK_LEN 256
+#define GANTT_BUF_SIZE (1 << 20)   // output buffer of the Gantt writer
+#define GANTT_POLL_NS 2000000      // writer poll interval while threads run
 
+// One Gantt line, formatted to text only when written out
 struct log {
-    int64_t ns;
-    char buf[MAX_LOG_SIZE];
+    int64_t start;
+    int64_t end;
+    int32_t tid;
+    int32_t core;
+    int32_t type;       // SCH_EVENT_CPU, IO_DONE, P or V
+    int32_t sem_id;
+};
+
+// Written only by the event listener, read concurrently by the Gantt writer
+struct log_chunk {
+    struct log_chunk *_Atomic next;
+    atomic_int count;
+    struct log log_data[LOG_CHUNK_LEN];
 };
 
 struct thread_struct {
     pthread_t p_t;                    // pthread identifier
     int tid;                          // tid
-    char line[MAX_LINE_SIZE];         // tid's operations
-    int64_t log_idx;                  // index of log_data to use for log_msg
-    struct log log_data[MAX_LOG_LEN]; // tid's log
+};
+
+// The Gantt chart in the order the scheduler reported it, a list of chunks.
+// The scheduler emits events under its lock and in simulated-time order, so
+// the log is already in output order and needs no merging.
+struct log_stream {
+    struct log_chunk *_Atomic head;
+    struct log_chunk *tail;           // chunk to use for log_event
+};
+
+// Streams the log to the Gantt file while threads are still running
+struct gantt_writer {
+    pthread_t p_t;
+    FILE *fp;
+    char *buf;
+    size_t len;
+    struct log_stream *log;
+    struct log_chunk *chunk;          // next entry to write is chunk[idx]
+    int idx;
+    atomic_bool done;                 // the scheduler has finished
 };
 
 void *thread_start(void *);
-int get_line_count(char *file_name);
+void fiber_start(int tid, void *arg);
+
+static int cpu_count = 1;       // with several CPUs the Gantt chart names the core
+static struct sch_workload workload;  // every thread's ops, parsed up front
+
+// Event listener, appends the events that make up the Gantt chart to the log
+void log_event(const struct sch_event *event, void *arg) {
+    struct log_stream *log = (struct log_stream *)arg;
+    switch (event->type) {
+    case SCH_EVENT_CPU:
+    case SCH_EVENT_IO_DONE:
+    case SCH_EVENT_P:
+    case SCH_EVENT_V:
+        break;
+    default:
+        return;
+    }
 
-// Log a message to log_data
-void log_msg(struct thread_struct *td, const char *format, ...) {
-    struct log *current_slot = &(td->log_data[td->log_idx]);
+    struct log_chunk *chunk = log->tail;
+    int count = chunk ? atomic_load_explicit(&chunk->count, memory_order_relaxed) : 0;
+    if (chunk == NULL || count == LOG_CHUNK_LEN) {
+        chunk = (struct log_chunk *)malloc(sizeof(*chunk));
+        if (!chunk) {
+            perror("malloc() error");
+            exit(EXIT_FAILURE);
+        }
+        atomic_init(&chunk->next, NULL);
+        atomic_init(&chunk->count, 0);
+        if (log->tail)
+            atomic_store_explicit(&log->tail->next, chunk, memory_order_release);
+        else
+            atomic_store_explicit(&log->head, chunk, memory_order_release);
+        log->tail = chunk;
+        count = 0;
+    }
+
+    struct log *current_slot = &(chunk->log_data[count]);
+    current_slot->tid = event->tid;
+    current_slot->core = event->core;
+    current_slot->type = event->type;
+    current_slot->start = event->start;
+    current_slot->end = event->end;
+    current_slot->sem_id = event->sem_id;
+
+    // publish the entry to the Gantt writer
+    atomic_store_explicit(&chunk->count, count + 1, memory_order_release);
+}
 
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    int64_t ns = (ts.tv_sec * 1000000000UL) + ts.tv_nsec;
-    current_slot->ns = ns;
+// Format a log entry as a Gantt line, returns its length
+int format_log(const struct log *entry, char *buf, size_t size) {
+    struct sch_event event = {
+        .type = entry->type,
+        .tid = entry->tid,
+        .core = entry->core,
+        .start = entry->start,
+        .end = entry->end,
+        .sem_id = entry->sem_id,
+    };
+    return format_gantt_line(buf, size, &event, cpu_count);
+}
 
-    va_list args;
-    va_start(args, format);
-    vsnprintf(current_slot->buf, MAX_LOG_SIZE, format, args);
-    va_end(args);
+// Next unwritten entry of the log, NULL if it has not been logged yet.
+// Chunks the writer is done with are freed here.
+struct log *writer_peek(struct gantt_writer *w) {
+    if (w->chunk == NULL) {
+        w->chunk = atomic_load_explicit(&(w->log->head), memory_order_acquire);
+        w->idx = 0;
+        if (w->chunk == NULL)
+            return NULL;
+    }
+    if (w->idx == LOG_CHUNK_LEN) {
+        struct log_chunk *next = atomic_load_explicit(&w->chunk->next, memory_order_acquire);
+        if (next == NULL)
+            return NULL;
+        free(w->chunk);
+        w->chunk = next;
+        w->idx = 0;
+    }
+    if (w->idx < atomic_load_explicit(&w->chunk->count, memory_order_acquire))
+        return &(w->chunk->log_data[w->idx]);
+    return NULL;
+}
 
-    td->log_idx++;
-    if (td->log_idx >= MAX_LOG_LEN) {
-        fprintf(stderr, "%s: Error, tid: %d, too many logs\n", __func__, td->tid);
+static void gantt_flush(struct gantt_writer *w) {
+    if (w->len > 0 && fwrite(w->buf, sizeof(char), w->len, w->fp) != w->len) {
+        fprintf(stderr, "fwrite() failed.\n");
         exit(EXIT_FAILURE);
     }
+    w->len = 0;
+}
+
+// Write every entry logged so far
+static void gantt_drain(struct gantt_writer *w) {
+    struct log *entry;
+    while ((entry = writer_peek(w)) != NULL) {
+        if (w->len + MAX_LOG_SIZE > GANTT_BUF_SIZE)
+            gantt_flush(w);
+        w->len += format_log(entry, w->buf + w->len, MAX_LOG_SIZE);
+        w->idx++;
+    }
+}
+
+void *gantt_writer_start(void *arg) {
+    struct gantt_writer *w = (struct gantt_writer *)arg;
+    struct timespec poll = {0, GANTT_POLL_NS};
+    while (true) {
+        bool done = atomic_load(&w->done);
+        gantt_drain(w);
+        if (done)
+            break; // every log was complete before this drain
+        nanosleep(&poll, NULL);
+    }
+    gantt_flush(w);
+    return NULL;
 }
 
 // Main function
 // Read input file and create threads accordingly
 int main(int argc, char **argv) {
     printf("%s: Hello Project 1!\n", __func__);
-    if (argc != 3) {
-        fprintf(stderr, "Not enough parameters specified. Usage: ./proj1 <scheduler_type> <input_file>\n");
+    if (argc < 3 || argc > 9) {
+        fprintf(stderr, "Not enough parameters specified. Usage: ./proj1 <scheduler_type> <input_file> [fiber_workers] [cpus] [migration_cost] [io_devices] [mlfq_config] [cfs_config]\n");
         fprintf(stderr, "  Scheduler type: 0 - First Come, First Served\n");
         fprintf(stderr, "  Scheduler type: 1 - Shortest Remaining Time First\n");
         fprintf(stderr, "  Scheduler type: 2 - Multi-Level Feedback Queue\n");
+        fprintf(stderr, "  Scheduler type: 3 - Completely Fair Scheduler\n");
+        fprintf(stderr, "  fiber_workers: run threads as fibers on this many OS threads (0: one pthread each)\n");
+        fprintf(stderr, "                negative: as fibers on -fiber_workers OS threads, each started at its arrival\n");
+        fprintf(stderr, "  cpus: number of simulated CPUs (default 1)\n");
+        fprintf(stderr, "  migration_cost: extra ticks for running on another CPU (default 0)\n");
+        fprintf(stderr, "  io_devices: one letter per I/O device, f - FIFO, s - shortest I/O first, p - MLFQ level priority (default f)\n");
+        fprintf(stderr, "  mlfq_config: MLFQ settings file, or settings like 'levels=3,quantum=4 8 16,discipline=rr rr fcfs,boost=200'\n");
+        fprintf(stderr, "  cfs_config: CFS settings file, or settings like 'latency=20,granularity=4'\n");
+        fprintf(stderr, "  Input 'I<duration>@<device>' sends an I/O to a device, plain 'I<duration>' to device 0\n");
+        fprintf(stderr, "  Input 'N<nice>' sets the thread's CFS nice value, -20 to 19\n");
+        fprintf(stderr, "  SCHED_CHECKPOINT=<time>:<file> saves the simulation once it reaches time\n");
+        fprintf(stderr, "  SCHED_RESTORE=<file> starts from a saved simulation, the same input, cpus and io_devices\n");
         exit(EXIT_FAILURE);
     }
 
     // Get parameters
     int scheduler_type = atoi(argv[1]);
-    int num_lines = get_line_count(argv[2]);
-    if (num_lines <= 0) {
-        fprintf(stderr, "%s: invalid input file.\n", __func__);
-        exit(EXIT_FAILURE);
-    }
-
-    int num_threads = num_lines;
-    printf("%s: Scheduler type: %d, number of threads: %d\n", __func__, scheduler_type, num_threads);
-
-    // Allocate thread_struct
-    struct thread_struct *threads;
-    threads = (struct thread_struct *)malloc(sizeof(*threads) * num_threads);
-    if (!threads) {
+    int fiber_workers = (argc >= 4) ? atoi(argv[3]) : 0;
+    bool stream = fiber_workers < 0;   // memory for live threads only
+    if (stream)
+        fiber_workers = -fiber_workers;
+    cpu_count = (argc >= 5) ? atoi(argv[4]) : 1;
+    int migration_cost = (argc >= 6) ? atoi(argv[5]) : 0;
+    if (cpu_count < 1)
+        cpu_count = 1;
+    const char *io_spec = (argc >= 7) ? argv[6] : "f";
+    int io_device_count = strlen(io_spec);
+    enum io_discipline *io_disciplines = (enum io_discipline *)malloc(sizeof(*io_disciplines) * (io_device_count + 1));
+    if (!io_disciplines) {
         perror("malloc() error");
         exit(EXIT_FAILURE);
     }
-    memset(threads, 0, sizeof(*threads) * num_threads);
-
-    // Read each line and save inside threads[].line
-    FILE *fp = fopen(argv[2], "r");
-    char *buf = (char *)malloc(sizeof(char) * MAX_LINE_SIZE);
-    for (int i = 0; i < num_threads; ++i) {
-        if (fgets(buf, MAX_LINE_SIZE, fp) == NULL) {
-            perror("fgets() error");
+    for (int i = 0; i < io_device_count; ++i) {
+        if (io_spec[i] == 'f') {
+            io_disciplines[i] = IO_FIFO;
+        } else if (io_spec[i] == 's') {
+            io_disciplines[i] = IO_SHORTEST;
+        } else if (io_spec[i] == 'p') {
+            io_disciplines[i] = IO_PRIORITY;
+        } else {
+            fprintf(stderr, "%s: invalid I/O discipline: %c\n", __func__, io_spec[i]);
             exit(EXIT_FAILURE);
         }
-        if (buf[strlen(buf) - 1] == '\n')
-            buf[strlen(buf) - 1] = '\0'; // remove newline
-
-        strncpy(threads[i].line, buf, MAX_LINE_SIZE);
     }
-    free(buf);
-    fclose(fp);
-
-    // Init scheduler
-    init_scheduler(scheduler_type, num_threads);
-
-    // Assign tid and create threads using threads[]
-    int ret = 0;
-    for (int i = 0; i < num_threads; ++i) {
-        threads[i].tid = i;
-        ret = pthread_create(&(threads[i].p_t), NULL, thread_start, &(threads[i]));
-        if (ret) {
-            fprintf(stderr, "%s: pthread_create() error!\n", __func__);
+    // An argument naming a readable file is a config file
+    struct sch_mlfq_config mlfq_config;
+    mlfq_default_config(&mlfq_config);
+    if (argc >= 8) {
+        struct stat st;
+        int err = stat(argv[7], &st) == 0 ? mlfq_load_config(argv[7], &mlfq_config)
+                                           : mlfq_parse_config(argv[7], &mlfq_config);
+        if (err) {
+            fprintf(stderr, "%s: invalid MLFQ config: %s\n", __func__, argv[7]);
             exit(EXIT_FAILURE);
         }
     }
-
-    // Join threads
-    for (int i = 0; i < num_threads; ++i) {
-        ret = pthread_join(threads[i].p_t, NULL);
-        if (ret) {
-            fprintf(stderr, "%s: pthread_join() error!\n", __func__);
+    struct sch_cfs_config cfs_config;
+    cfs_default_config(&cfs_config);
+    if (argc >= 9) {
+        struct stat st;
+        int err = stat(argv[8], &st) == 0 ? cfs_load_config(argv[8], &cfs_config)
+                                           : cfs_parse_config(argv[8], &cfs_config);
+        if (err) {
+            fprintf(stderr, "%s: invalid CFS config: %s\n", __func__, argv[8]);
             exit(EXIT_FAILURE);
         }
     }
 
-    finish_scheduler();
+    // Parse the whole input before any thread runs
+    if (workload_load(argv[2], &workload) != 0) {
+        fprintf(stderr, "%s: invalid input file.\n", __func__);
+        exit(EXIT_FAILURE);
+    }
+
+    int num_threads = workload.thread_count;
+    printf("%s: Scheduler type: %d, number of threads: %d\n", __func__, scheduler_type, num_threads);
+
+    // Allocate thread_struct, a stream run starts its threads itself
+    struct thread_struct *threads = NULL;
+    if (!stream) {
+        threads = (struct thread_struct *)malloc(sizeof(*threads) * num_threads);
+        if (!threads) {
+            perror("malloc() error");
+            exit(EXIT_FAILURE);
+        }
+        memset(threads, 0, sizeof(*threads) * num_threads);
+    }
 
     // Open file for Gantt chart
     FILE *gantt_file = NULL;
@@ -142,43 +290,109 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
-    // write the thread logs to gantt_file
-    int64_t *cmp_idx = (int64_t *)malloc(sizeof(*cmp_idx) * num_threads);
-    memset(cmp_idx, 0, sizeof(int64_t) * num_threads);
-    while (true) {
-        int64_t current_min_ns = INT64_MAX;
-        int current_min_tid = -1;
+    // Init scheduler, the Gantt chart is built from its event stream
+    struct log_stream log = {0};
+    init_scheduler_smp(scheduler_type, stream ? 0 : num_threads, cpu_count, migration_cost);
+    if (io_device_count > 0)
+        configure_io_devices(io_device_count, io_disciplines);
+    free(io_disciplines);
+    configure_mlfq(&mlfq_config);
+    configure_cfs(&cfs_config);
+    set_event_listener(log_event, &log);
+
+    // Metrics go next to the Gantt chart
+    char metrics_prefix[512] = {0};
+    snprintf(metrics_prefix, sizeof(metrics_prefix), "output/metrics-%s-%s", argv[1], basename(argv[2]));
+    set_metrics_output(metrics_prefix);
+
+    // Checkpoints, not of a stream run
+    const char *checkpoint = getenv("SCHED_CHECKPOINT");
+    const char *restore = getenv("SCHED_RESTORE");
+    if (stream && (checkpoint || restore)) {
+        fprintf(stderr, "%s: a stream run has no checkpoints\n", __func__);
+        exit(EXIT_FAILURE);
+    }
+    if (checkpoint) {
+        char *end;
+        long long time = strtoll(checkpoint, &end, 10);
+        if (end == checkpoint || *end != ':' || end[1] == '\0') {
+            fprintf(stderr, "%s: invalid SCHED_CHECKPOINT: %s\n", __func__, checkpoint);
+            exit(EXIT_FAILURE);
+        }
+        checkpoint_at(time, end + 1);
+    }
+    if (restore && restore_checkpoint(restore, &workload) != 0) {
+        fprintf(stderr, "%s: cannot restore %s\n", __func__, restore);
+        exit(EXIT_FAILURE);
+    }
+
+    // Assign tid and create threads using threads[]
+    int ret = 0;
+    for (int i = 0; threads && i < num_threads; ++i) {
+        threads[i].tid = i;
+    }
+
+    // Start writing the log to gantt_file while threads run
+    struct gantt_writer writer = {0};
+    writer.fp = gantt_file;
+    writer.log = &log;
+    writer.buf = (char *)malloc(GANTT_BUF_SIZE);
+    if (!writer.buf) {
+        perror("malloc() error");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&writer.done, false);
+    ret = pthread_create(&(writer.p_t), NULL, gantt_writer_start, &writer);
+    if (ret) {
+        fprintf(stderr, "%s: pthread_create() error!\n", __func__);
+        exit(EXIT_FAILURE);
+    }
 
-        // find tid of smallest ns
+    if (stream) {
+        // Threads start as the simulation reaches their arrival
+        run_stream(fiber_workers, &workload);
+    } else if (fiber_workers > 0) {
+        // Multiplex all threads as fibers on fiber_workers OS threads
+        run_fibers(fiber_workers, fiber_start, threads);
+    } else {
         for (int i = 0; i < num_threads; ++i) {
-            struct thread_struct *cmp_ts = &(threads[i]);
-            if (cmp_ts->log_idx <= cmp_idx[i])
-                continue; // done for this thread
-            if (cmp_ts->log_data[cmp_idx[i]].ns < current_min_ns) {
-                current_min_ns = cmp_ts->log_data[cmp_idx[i]].ns;
-                current_min_tid = i;
+            ret = pthread_create(&(threads[i].p_t), NULL, thread_start, &(threads[i]));
+            if (ret) {
+                fprintf(stderr, "%s: pthread_create() error!\n", __func__);
+                exit(EXIT_FAILURE);
             }
         }
 
-        // written all logs, nothing left
-        if (current_min_tid == -1)
-            break;
-
-        // write log to file
-        char *log = threads[current_min_tid].log_data[cmp_idx[current_min_tid]].buf;
-        size_t ret = fwrite(log, sizeof(char), strlen(log), gantt_file);
-        if (ret != strlen(log)) {
-            fprintf(stderr, "fwrite() failed.\n");
-            exit(EXIT_FAILURE);
+        // Join threads
+        for (int i = 0; i < num_threads; ++i) {
+            ret = pthread_join(threads[i].p_t, NULL);
+            if (ret) {
+                fprintf(stderr, "%s: pthread_join() error!\n", __func__);
+                exit(EXIT_FAILURE);
+            }
         }
-
-        // increment the index to next slot
-        cmp_idx[current_min_tid]++;
     }
-    free(cmp_idx);
 
+    finish_scheduler();
+
+    // Let the writer finish the remaining logs
+    atomic_store(&writer.done, true);
+    ret = pthread_join(writer.p_t, NULL);
+    if (ret) {
+        fprintf(stderr, "%s: pthread_join() error!\n", __func__);
+        exit(EXIT_FAILURE);
+    }
     fclose(gantt_file);
+
+    struct log_chunk *chunk = writer.chunk;
+    while (chunk) {
+        struct log_chunk *next = atomic_load(&chunk->next);
+        free(chunk);
+        chunk = next;
+    }
+    free(writer.buf);
     free(threads);
+    workload_free(&workload);
 
     // sort
     // char sort_command[2048];
@@ -191,115 +405,15 @@ int main(int argc, char **argv) {
 }
 
 // Thread starting point
-// Independently read each line and call C/I/P/V/E
+// Independently run the thread's C/I/P/V/N/E ops
 void *thread_start(void *arg) {
     struct thread_struct *my_info = (struct thread_struct *)arg;
-    int tid = my_info->tid;
-
-    // read tokens
-    char *token = NULL;
-    char delim[3] = "\t ";
-    char *saveptr;
-
-    // arrival time
-    token = strtok_r(my_info->line, delim, &saveptr);
-    float arrival_time = atof(token);
-
-    // the first operation (C/I/P/V) call from this thread is the arrival time in input file
-    float schedule_time = arrival_time;
-
-    // tid
-    token = strtok_r(NULL, delim, &saveptr);
-    if (tid != atoi(token)) {
-        fprintf(stderr, "%s: tid: %d, incorrect tid\n", __func__, tid);
-        exit(EXIT_FAILURE);
-    }
-
-    // loop until 'E'
-    token = strtok_r(NULL, delim, &saveptr);
-    while (token) {
-        // save the return value (time) of C/I/P/V
-        int ret_time = 0;
-
-        // parse token
-        if (token[0] == 'C') {
-            int duration = atoi(&(token[1]));
-            while (duration >= 0) {
-                ret_time = cpu_me(schedule_time, tid, duration);
-                // return from cpu_me()
-                if (duration > 0)
-                    // only print when CPU is actually requested
-                    // (if duration is 0, we are just notifying the scheduler)
-                    // this tid had cpu from 'ret_time-1' to 'ret_time'
-                    log_msg(my_info, "%3d~%3d: T%d, CPU\n", ret_time - 1, ret_time, tid);
-
-                // values for the next cpu_me() call
-                schedule_time = ret_time;
-                duration = duration - 1;
-            }
-        } else if (token[0] == 'I') {
-            int duration = atoi(&(token[1]));
-            ret_time = io_me(schedule_time, tid, duration);
-            // return from io_me()
-            // this tid finished IO at time 'ret_time'
-            log_msg(my_info, "   ~%3d: T%d, Return from IO\n", ret_time, tid);
-        } else if (token[0] == 'P') {
-            int sem_id = atoi(&(token[1]));
-            ret_time = P(schedule_time, tid, sem_id);
-            // return from P()
-            // this tid finished P at time 'ret_time'
-            log_msg(my_info, "   ~%3d: T%d, Return from P%d\n", ret_time, tid, sem_id);
-        } else if (token[0] == 'V') {
-            int sem_id = atoi(&(token[1]));
-            ret_time = V(schedule_time, tid, sem_id);
-            // return from V()
-            // this tid finished V at time 'ret_time'
-            log_msg(my_info, "   ~%3d: T%d, Return from V%d\n", ret_time, tid, sem_id);
-        } else if (token[0] == 'E') {
-            // this thread is finished, notify scheduler
-            end_me(tid);
-
-            // end this thread normally
-            return NULL;
-        } else {
-            fprintf(stderr, "%s: Error, tid: %d, invalid token: %c%c\n", __func__, tid, token[0], token[1]);
-            exit(EXIT_FAILURE);
-        }
-
-        // get next token
-        token = strtok_r(NULL, delim, &saveptr);
-
-        // call the next operation without any time delay
-        schedule_time = ret_time;
-    }
-
-    // No 'E' found in input file
-    fprintf(stderr, "%s: Error, tid: %d, thread finished without 'E' operation\n", __func__, tid);
-    exit(EXIT_FAILURE);
+    replay_thread(&workload, my_info->tid);
+    return NULL;
 }
 
-// From file_name, get the number of lines and do error check
-int get_line_count(char *file_name) {
-    FILE *fp = fopen(file_name, "r");
-    if (!fp) {
-        perror("fopen() error");
-        exit(EXIT_FAILURE);
-    }
-
-    int num_lines = 0;
-    char arrival_time[512];
-    int temp;
-    char *buf = (char *)malloc(sizeof(char) * MAX_LINE_SIZE);
-    while (fgets(buf, MAX_LINE_SIZE, fp) != NULL) {
-        // Check tid of the input file. tid starts from 0
-        sscanf(buf, "%s %d", arrival_time, &temp);
-        if (temp != num_lines) {
-            exit(EXIT_FAILURE);
-        }
-        ++num_lines;
-    }
-    free(buf);
-
-    fclose(fp);
-    return num_lines;
+// Fiber starting point, same as thread_start
+void fiber_start(int tid, void *arg) {
+    struct thread_struct *threads = (struct thread_struct *)arg;
+    thread_start(&(threads[tid]));
 }
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+
+// Decode a binary trace written with SCHED_TRACE=<file> into text, one
+// event per line in global sequence order.
+
+static const char *kind_names[TRACE_KIND_COUNT] = {
+    [TRACE_CALL_CPU] = "cpu_me",
+    [TRACE_CALL_IO] = "io_me",
+    [TRACE_CALL_P] = "P",
+    [TRACE_CALL_V] = "V",
+    [TRACE_CALL_END] = "end_me",
+    [TRACE_TIME] = "time",
+    [TRACE_DISPATCH] = "dispatch",
+    [TRACE_DEMOTE] = "demote",
+    [TRACE_RETURN] = "return",
+    [TRACE_STEAL] = "steal",
+    [TRACE_BOOST] = "boost",
+};
+
+static int cmp_seq(const void *a, const void *b) {
+    const trace_record_t *ra = a;
+    const trace_record_t *rb = b;
+    return (ra->seq > rb->seq) - (ra->seq < rb->seq);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: ./trace_decode <trace_file>\n");
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *fp = fopen(argv[1], "rb");
+    if (!fp) {
+        perror("fopen() error");
+        exit(EXIT_FAILURE);
+    }
+
+    char magic[8];
+    uint32_t version, record_size;
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0 ||
+        fread(&version, sizeof(version), 1, fp) != 1 ||
+        fread(&record_size, sizeof(record_size), 1, fp) != 1) {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    if (version != TRACE_VERSION || record_size != sizeof(trace_record_t)) {
+        fprintf(stderr, "%s: unsupported trace version %u\n", argv[1], version);
+        exit(EXIT_FAILURE);
+    }
+
+    // Gather the records of every ring
+    trace_record_t *records = NULL;
+    size_t count = 0;
+    uint32_t ring_id, ring_count;
+    while (fread(&ring_id, sizeof(ring_id), 1, fp) == 1 &&
+           fread(&ring_count, sizeof(ring_count), 1, fp) == 1) {
+        records = realloc(records, sizeof(*records) * (count + ring_count));
+        if (!records) {
+            perror("realloc() error");
+            exit(EXIT_FAILURE);
+        }
+        if (fread(&records[count], sizeof(*records), ring_count, fp) != ring_count) {
+            fprintf(stderr, "%s: truncated ring %u\n", argv[1], ring_id);
+            exit(EXIT_FAILURE);
+        }
+        count += ring_count;
+    }
+    fclose(fp);
+
+    qsort(records, count, sizeof(*records), cmp_seq);
+    for (size_t i = 0; i < count; i++) {
+        trace_record_t *r = &records[i];
+        const char *name = r->kind < TRACE_KIND_COUNT ? kind_names[r->kind] : "unknown";
+        printf("%8llu t=%-6lld T%-4d %-8s %d %d\n", (unsigned long long)r->seq, (long long)r->time, r->tid, name, r->a, r->b);
+    }
+
+    free(records);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "api.h"
+
+// Workload compiler
+// Parses a tester input file once and writes it as a compiled workload,
+// which the tester, batch and the library map and run without parsing.
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: ./workload_compile <input_file> <output_file>\n");
+        exit(EXIT_FAILURE);
+    }
+    struct sch_workload workload = {0};
+    if (workload_load(argv[1], &workload) != 0) {
+        fprintf(stderr, "%s: invalid input file.\n", __func__);
+        exit(EXIT_FAILURE);
+    }
+    int err = workload_save(argv[2], &workload);
+    if (!err)
+        printf("%d threads, %llu ops\n", workload.thread_count, (unsigned long long)workload.op_count);
+    workload_free(&workload);
+    return err ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+// Synthetic workload generator
+// Writes a tester input file, one "arrival tid ops... E" line per thread,
+// from seeded distributions. The same options and seed always give the same
+// file. Lines are streamed out, so the size is only limited by the disk.
+//
+// Semaphore patterns are deadlock-free by construction:
+//   mutex   one critical section "P s C V s" per thread, the first threads
+//           only V to give every semaphore its token
+//   nested  like mutex but two locks, always taken in increasing sem_id order
+//   pairs   thread 2k produces with V, thread 2k+1 consumes the same count
+//           with P on its own semaphore, producers never block
+
+#define OUT_BUF_SIZE (1 << 20)
+#define MAX_BURST 1000000
+
+enum burst_dist {
+    BURST_EXP,      // exponential
+    BURST_PARETO,   // heavy-tailed
+};
+
+enum sem_pattern {
+    SEM_NONE,
+    SEM_MUTEX,
+    SEM_NESTED,
+    SEM_PAIRS,
+};
+
+struct gen_config {
+    long num_threads;
+    uint64_t seed;
+    double arrival_rate;    // threads per tick, Poisson
+    int bursts;             // CPU bursts per thread
+    enum burst_dist dist;
+    double burst_mean;
+    double pareto_alpha;
+    double io_ratio;        // chance of an I/O after each burst but the last
+    double io_mean;
+    int io_devices;         // > 1 adds @device to I/O ops
+    enum sem_pattern pattern;
+    int num_sems;
+};
+
+static uint64_t rng_state;
+
+static uint64_t rng_next() {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static void rng_seed(uint64_t seed) {
+    // splitmix64, xorshift must not start at 0
+    uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    rng_state = (z ^ (z >> 31)) | 1;
+}
+
+// Uniform in [0, 1)
+static double rng_uniform() {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double rng_exp(double mean) {
+    return -mean * log(1.0 - rng_uniform());
+}
+
+// Pareto with the given mean, alpha > 1
+static double rng_pareto(double mean, double alpha) {
+    double scale = mean * (alpha - 1) / alpha;
+    return scale / pow(1.0 - rng_uniform(), 1.0 / alpha);
+}
+
+// Duration of at least 1 tick
+static int duration(double value) {
+    long v = lround(value);
+    if (v < 1)
+        return 1;
+    return v > MAX_BURST ? MAX_BURST : (int)v;
+}
+
+static int cpu_burst(const struct gen_config *cfg) {
+    if (cfg->dist == BURST_PARETO)
+        return duration(rng_pareto(cfg->burst_mean, cfg->pareto_alpha));
+    return duration(rng_exp(cfg->burst_mean));
+}
+
+static void put_io(const struct gen_config *cfg, FILE *out) {
+    fprintf(out, " I%d", duration(rng_exp(cfg->io_mean)));
+    if (cfg->io_devices > 1)
+        fprintf(out, "@%d", (int)(rng_next() % cfg->io_devices));
+}
+
+// The bursts of one thread, with I/O in between. The critical section, if
+// any, wraps burst cs_burst.
+static void put_bursts(const struct gen_config *cfg, FILE *out, int cs_burst, int lock_a, int lock_b) {
+    for (int i = 0; i < cfg->bursts; ++i) {
+        if (i == cs_burst) {
+            fprintf(out, " P%d", lock_a);
+            if (lock_b >= 0)
+                fprintf(out, " P%d", lock_b);
+        }
+        fprintf(out, " C%d", cpu_burst(cfg));
+        if (i == cs_burst) {
+            if (lock_b >= 0)
+                fprintf(out, " V%d", lock_b);
+            fprintf(out, " V%d", lock_a);
+        }
+        if (i + 1 < cfg->bursts && rng_uniform() < cfg->io_ratio)
+            put_io(cfg, out);
+    }
+}
+
+static void generate(const struct gen_config *cfg, FILE *out) {
+    rng_seed(cfg->seed);
+    double time = 0;
+    for (long tid = 0; tid < cfg->num_threads; ++tid) {
+        time += rng_exp(1.0 / cfg->arrival_rate);
+        fprintf(out, "%.1f %ld", floor(time * 10) / 10, tid);
+
+        switch (cfg->pattern) {
+        case SEM_MUTEX:
+        case SEM_NESTED:
+            if (tid < cfg->num_sems) {
+                // hands out the token, never waits
+                fprintf(out, " V%ld", tid);
+                put_bursts(cfg, out, -1, -1, -1);
+            } else {
+                int lock_a = rng_next() % cfg->num_sems;
+                int lock_b = -1;
+                if (cfg->pattern == SEM_NESTED && cfg->num_sems > 1) {
+                    lock_b = rng_next() % (cfg->num_sems - 1);
+                    if (lock_b >= lock_a)
+                        lock_b++;
+                    if (lock_b < lock_a) {
+                        int tmp = lock_a;
+                        lock_a = lock_b;
+                        lock_b = tmp;
+                    }
+                }
+                put_bursts(cfg, out, rng_next() % cfg->bursts, lock_a, lock_b);
+            }
+            break;
+        case SEM_PAIRS: {
+            // A consumer P's once per burst of its producer, producers only V
+            long sem_id = tid / 2;
+            bool last_unpaired = (tid % 2 == 0) && (tid + 1 == cfg->num_threads);
+            for (int i = 0; i < cfg->bursts; ++i) {
+                if (tid % 2 == 1)
+                    fprintf(out, " P%ld", sem_id);
+                fprintf(out, " C%d", cpu_burst(cfg));
+                if (tid % 2 == 0 && !last_unpaired)
+                    fprintf(out, " V%ld", sem_id);
+                if (i + 1 < cfg->bursts && rng_uniform() < cfg->io_ratio)
+                    put_io(cfg, out);
+            }
+            break;
+        }
+        default:
+            put_bursts(cfg, out, -1, -1, -1);
+            break;
+        }
+        fprintf(out, " E\n");
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: ./workload_gen [options] > input_file\n");
+    fprintf(stderr, "  -n threads     number of threads (default 100)\n");
+    fprintf(stderr, "  -s seed        random seed (default 1)\n");
+    fprintf(stderr, "  -r rate        Poisson arrivals per tick (default 0.1)\n");
+    fprintf(stderr, "  -b bursts      CPU bursts per thread (default 3)\n");
+    fprintf(stderr, "  -c mean        mean CPU burst (default 5)\n");
+    fprintf(stderr, "  -t alpha       heavy-tailed Pareto bursts with this alpha > 1 (default exponential)\n");
+    fprintf(stderr, "  -i ratio       chance of an I/O between bursts (default 0.5)\n");
+    fprintf(stderr, "  -d mean        mean I/O duration (default 5)\n");
+    fprintf(stderr, "  -D devices     spread I/O over devices with I<d>@<device> (default 1)\n");
+    fprintf(stderr, "  -p pattern     semaphores: none, mutex, nested or pairs (default none)\n");
+    fprintf(stderr, "  -k sems        semaphores for mutex and nested (default 4)\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    struct gen_config cfg = {
+        .num_threads = 100,
+        .seed = 1,
+        .arrival_rate = 0.1,
+        .bursts = 3,
+        .dist = BURST_EXP,
+        .burst_mean = 5,
+        .pareto_alpha = 1.5,
+        .io_ratio = 0.5,
+        .io_mean = 5,
+        .io_devices = 1,
+        .pattern = SEM_NONE,
+        .num_sems = 4,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:r:b:c:t:i:d:D:p:k:")) != -1) {
+        switch (opt) {
+        case 'n': cfg.num_threads = atol(optarg); break;
+        case 's': cfg.seed = strtoull(optarg, NULL, 0); break;
+        case 'r': cfg.arrival_rate = atof(optarg); break;
+        case 'b': cfg.bursts = atoi(optarg); break;
+        case 'c': cfg.burst_mean = atof(optarg); break;
+        case 't':
+            cfg.dist = BURST_PARETO;
+            cfg.pareto_alpha = atof(optarg);
+            break;
+        case 'i': cfg.io_ratio = atof(optarg); break;
+        case 'd': cfg.io_mean = atof(optarg); break;
+        case 'D': cfg.io_devices = atoi(optarg); break;
+        case 'p':
+            if (strcmp(optarg, "none") == 0) {
+                cfg.pattern = SEM_NONE;
+            } else if (strcmp(optarg, "mutex") == 0) {
+                cfg.pattern = SEM_MUTEX;
+            } else if (strcmp(optarg, "nested") == 0) {
+                cfg.pattern = SEM_NESTED;
+            } else if (strcmp(optarg, "pairs") == 0) {
+                cfg.pattern = SEM_PAIRS;
+            } else {
+                usage();
+            }
+            break;
+        case 'k': cfg.num_sems = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (optind != argc || cfg.num_threads < 1 || cfg.arrival_rate <= 0 || cfg.bursts < 1 ||
+        cfg.burst_mean <= 0 || cfg.pareto_alpha <= 1 || cfg.io_mean <= 0 || cfg.io_devices < 1 ||
+        cfg.num_sems < 1)
+        usage();
+    if (cfg.num_sems > cfg.num_threads)
+        cfg.num_sems = cfg.num_threads;
+
+    static char out_buf[OUT_BUF_SIZE];
+    setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+    generate(&cfg, stdout);
+    if (fflush(stdout) != 0) {
+        perror("fflush() error");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}